@@ -0,0 +1,511 @@
+/* DEFINES */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define KILO_NO_MAIN
+#define BENCH_SCREEN_ROWS 50
+#define BENCH_SCREEN_COLS 200
+#define BENCH_FRAMES 2000
+#define BENCH_LARGE_LINE_MB 2200 // past 2 GiB
+#define BENCH_LARGE_FILE_MB 4400 // past 4 GiB
+
+/* INCLUDES */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+
+/* ALLOCATION COUNTING */
+// kilo.c is compiled into this file, so routing its allocator calls through
+// these macros counts every malloc the editor makes during a benchmark.
+typedef struct benchAllocStats {
+    unsigned long long allocs;
+    unsigned long long bytes;
+} benchAllocStats;
+
+benchAllocStats A;
+
+void *benchMalloc(size_t n) {
+    A.allocs++;
+    A.bytes += n;
+    return malloc(n);
+}
+
+void *benchCalloc(size_t nmemb, size_t n) {
+    A.allocs++;
+    A.bytes += nmemb * n;
+    return calloc(nmemb, n);
+}
+
+void *benchRealloc(void *p, size_t n) {
+    A.allocs++;
+    A.bytes += n;
+    return realloc(p, n);
+}
+
+char *benchStrdup(const char *s) {
+    A.allocs++;
+    A.bytes += strlen(s) + 1;
+    return strdup(s);
+}
+
+#define malloc benchMalloc
+#define calloc benchCalloc
+#define realloc benchRealloc
+#define strdup benchStrdup
+
+// the system headers above already saw these, let kilo.c define them again
+#undef _DEFAULT_SOURCE
+#undef _BSD_SOURCE
+#undef _GNU_SOURCE
+#undef _FILE_OFFSET_BITS
+
+#include "kilo.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+/* DATA */
+typedef struct benchResult {
+    const char *name;
+    long long lines;
+    double seconds;
+    double ops;
+    double bytes;
+    benchAllocStats alloc;
+    memCounter mem[MEM_TAGS]; // live after the run, peak and allocations during it
+} benchResult;
+
+typedef struct benchTimer {
+    struct timespec start;
+    benchAllocStats alloc;
+    unsigned long long memAllocs[MEM_TAGS];
+} benchTimer;
+
+/* PROTOTYPES */
+// harness
+void benchStart(benchTimer *t);
+void benchStop(benchTimer *t, benchResult *r);
+void benchReport(benchResult *r);
+void benchSetup(void);
+size_t benchGenerate(const char *path, long long lines);
+
+// benchmarks
+void benchOpen(const char *path, long long lines, size_t bytes);
+void benchReopen(const char *path, long long lines, size_t bytes);
+void benchSyntax(long long lines);
+void benchFind(long long lines);
+void benchDraw(long long lines);
+void benchSave(const char *path, long long lines);
+
+// large files
+void benchCheck(int ok, const char *what);
+void benchCheckRow(editorRow *row, ssize_t size, const char *end);
+void benchCheckFile(const char *path, off_t offset, const char *expect);
+void benchLarge(const char *dir, size_t linemb, size_t filemb);
+
+// key checks
+void benchKeys(const char *keys);
+void benchCheckRows(editorBuffer *buf, const char *expect, const char *what);
+void benchClipboard(void);
+
+/* HARNESS */
+void benchStart(benchTimer *t) {
+    t->alloc = A;
+    memResetPeaks();
+    for (int i = 0; i < MEM_TAGS; i++) t->memAllocs[i] = E.mem[i].allocs;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+void benchStop(benchTimer *t, benchResult *r) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    r->seconds = (end.tv_sec - t->start.tv_sec) + (end.tv_nsec - t->start.tv_nsec) / 1e9;
+    r->alloc.allocs = A.allocs - t->alloc.allocs;
+    r->alloc.bytes = A.bytes - t->alloc.bytes;
+    for (int i = 0; i < MEM_TAGS; i++) {
+        r->mem[i] = E.mem[i];
+        r->mem[i].allocs -= t->memAllocs[i];
+    }
+}
+
+// One JSON object per line so results can be diffed or fed to other tools.
+void benchReport(benchResult *r) {
+    double secs = r->seconds > 0 ? r->seconds : 1e-9;
+    printf("{\"bench\":\"%s\",\"lines\":%lld,\"seconds\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+           "\"allocs\":%llu,\"alloc_bytes\":%llu,\"mem\":{",
+           r->name, r->lines, r->seconds,
+           r->ops / secs, r->bytes / secs / (1024 * 1024),
+           r->alloc.allocs, r->alloc.bytes);
+    for (int i = 0; i < MEM_TAGS; i++)
+        printf("%s\"%s\":{\"live\":%lld,\"peak\":%lld,\"allocs\":%llu}", i ? "," : "",
+               MEM_TAG_NAMES[i], r->mem[i].live, r->mem[i].peak, r->mem[i].allocs);
+    printf("}}\n");
+    fflush(stdout);
+}
+
+void benchSetup(void) {
+    E.screenrows = BENCH_SCREEN_ROWS;
+    E.screencols = BENCH_SCREEN_COLS;
+    E.numviews = 1;
+    E.view = &E.views[0];
+    editorShowBuffer(E.view, editorNewBuffer());
+    editorLayoutViews();
+}
+
+// Writes a C-like file mixing keywords, strings, numbers, comments and tabs
+// so every highlighting path gets exercised.
+size_t benchGenerate(const char *path, long long lines) {
+    static const char *templates[] = {
+        "int value%lld = %lld; // counter",
+        "\tif (value > 42 && name[0] == 'x') return \"match %lld\";",
+        "    for (unsigned int i = 0; i < %lld; i++) total += i * 3.14;",
+        "/* block comment %lld",
+        "   still in the comment %lld */",
+        "static char *label%lld = \"log line with some payload text\";",
+        "\t\tswitch (state) { case %lld: break; default: continue; }",
+        "2024-01-01T00:00:00Z INFO request %lld served in 12ms",
+    };
+    int ntemplates = sizeof(templates) / sizeof(templates[0]);
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) die("fopen");
+
+    size_t bytes = 0;
+    for (long long i = 0; i < lines; i++) {
+        int n = fprintf(fp, templates[i % ntemplates], i, i);
+        fputc('\n', fp);
+        bytes += n + 1;
+    }
+    fclose(fp);
+
+    return bytes;
+}
+
+/* BENCHMARKS */
+void benchOpen(const char *path, long long lines, size_t bytes) {
+    editorBuffer *buf = E.view->buf;
+    benchResult r = { "open", lines, 0, lines, bytes, {0, 0}, {{0, 0, 0}} };
+    benchTimer t;
+
+    benchStart(&t);
+    editorOpen(buf, (char *)path);
+    benchStop(&t, &r);
+    benchReport(&r);
+}
+
+// The first open leaves a line cache behind for files of KILO_CACHE_MIN_BYTES
+// or more, so this measures the cached path. Smaller files get no cache and
+// are reported as reopen_uncached.
+void benchReopen(const char *path, long long lines, size_t bytes) {
+    editorBuffer *buf = E.view->buf;
+    char cache[PATH_MAX];
+    int cached = cachePath(path, cache, sizeof(cache)) == 0 && access(cache, F_OK) == 0;
+    benchResult r = { cached ? "reopen" : "reopen_uncached", lines, 0, lines, bytes, {0, 0}, {{0, 0, 0}} };
+    benchTimer t;
+
+    benchStart(&t);
+    editorOpen(buf, (char *)path);
+    benchStop(&t, &r);
+    benchReport(&r);
+}
+
+void benchSyntax(long long lines) {
+    editorBuffer *buf = E.view->buf;
+    size_t bytes = 0;
+    for (ssize_t i = 0; i < buf->numrows; i++) bytes += buf->row[i].rsize;
+
+    benchResult r = { "syntax", lines, 0, lines, bytes, {0, 0}, {{0, 0, 0}} };
+    benchTimer t;
+
+    benchStart(&t);
+    editorSelectSyntaxHighlight(buf);
+    benchStop(&t, &r);
+    benchReport(&r);
+}
+
+void benchFind(long long lines) {
+    editorBuffer *buf = E.view->buf;
+    size_t bytes = 0;
+    for (ssize_t i = 0; i < buf->numrows; i++) bytes += buf->row[i].rsize;
+
+    // a query that only matches the last line forces a scan of every row
+    char query[64];
+    snprintf(query, sizeof(query), "request %lld served", lines - 1 - ((lines - 1) % 8 + 1) % 8);
+    benchResult r = { "find", lines, 0, lines, bytes, {0, 0}, {{0, 0, 0}} };
+    benchTimer t;
+
+    benchStart(&t);
+    editorFindCallback(query, 'x');
+    benchStop(&t, &r);
+    editorFindCallback(query, '\r');
+    benchReport(&r);
+}
+
+void benchDraw(long long lines) {
+    editorView *v = E.view;
+    appendBuffer ab = ABUF_INIT;
+    benchResult r = { "draw", lines, 0, BENCH_FRAMES, 0, {0, 0}, {{0, 0, 0}} };
+    benchTimer t;
+
+    benchStart(&t);
+    for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+        v->cy = (ssize_t)((unsigned long long)frame * 7919 % (v->buf->numrows + 1));
+        v->cx = 0;
+        editorScroll(v);
+        ab.len = 0;
+        editorDrawRows(v, &ab);
+        r.bytes += ab.len;
+    }
+    benchStop(&t, &r);
+    abFree(&ab);
+    benchReport(&r);
+}
+
+void benchSave(const char *path, long long lines) {
+    editorBuffer *buf = E.view->buf;
+    size_t bytes = 0;
+    for (ssize_t i = 0; i < buf->numrows; i++) bytes += buf->row[i].size + 1;
+
+    free(buf->filename);
+    buf->filename = strdup(path);
+    benchResult r = { "save", lines, 0, lines, bytes, {0, 0}, {{0, 0, 0}} };
+    benchTimer t;
+
+    benchStart(&t);
+    editorSave(buf);
+    benchStop(&t, &r);
+    benchReport(&r);
+}
+
+/* LARGE FILES */
+// Opens, edits, draws, saves and reopens a file past 4 GiB whose two long
+// lines are each past 2 GiB, checking rows and saved bytes at every step so a
+// size or offset truncated to 32 bits shows up as a failure. The long lines
+// are holes in a sparse file, so generating it writes almost nothing.
+void benchCheck(int ok, const char *what) {
+    if (ok) return;
+    fprintf(stderr, "check failed: %s\n", what);
+    exit(1);
+}
+
+void benchCheckRow(editorRow *row, ssize_t size, const char *end) {
+    size_t len = strlen(end);
+    benchCheck(row->size == size, "row size");
+    benchCheck(!memcmp(&row->chars[row->size - len], end, len), "row end");
+}
+
+void benchCheckFile(const char *path, off_t offset, const char *expect) {
+    char got[64];
+    size_t len = strlen(expect);
+
+    int fd = open(path, O_RDONLY);
+    benchCheck(fd != -1, "open saved file");
+    benchCheck(pread(fd, got, len, offset) == (ssize_t)len, "read saved file");
+    benchCheck(!memcmp(got, expect, len), "saved bytes");
+    close(fd);
+}
+
+void benchLarge(const char *dir, size_t linemb, size_t filemb) {
+    static const char head[] = "first line\n", tail[] = "last line\n";
+    char src[64], dst[64];
+    snprintf(src, sizeof(src), "%s/large.txt", dir);
+    snprintf(dst, sizeof(dst), "%s/large-out.txt", dir);
+
+    // first line, long line a, long line b filling up to the file size, last line
+    ssize_t alen = (ssize_t)linemb << 20;
+    off_t size = (off_t)filemb << 20;
+    off_t aoff = sizeof(head) - 1;
+    off_t boff = aoff + alen + 1;
+    ssize_t blen = size - boff - 1 - (off_t)(sizeof(tail) - 1);
+    benchCheck(blen >= 16, "file size leaves room for both long lines");
+
+    int fd = open(src, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) die("open");
+    if (pwrite(fd, head, sizeof(head) - 1, 0) == -1 ||
+        pwrite(fd, "<<a>>\n", 6, boff - 6) == -1 ||
+        pwrite(fd, "<<b>>\n", 6, boff + blen - 5) == -1 ||
+        pwrite(fd, tail, sizeof(tail) - 1, size - (off_t)(sizeof(tail) - 1)) == -1) die("pwrite");
+    close(fd);
+
+    editorView *v = E.view;
+    editorBuffer *buf = v->buf;
+    benchTimer t;
+
+    benchResult open = { "large_open", 4, 0, 4, size, {0, 0}, {{0, 0, 0}} };
+    benchStart(&t);
+    editorOpen(buf, (char *)src);
+    benchStop(&t, &open);
+    benchCheck(buf->numrows == 4, "rows after open");
+    benchCheckRow(&buf->row[0], sizeof(head) - 2, "first line");
+    benchCheckRow(&buf->row[1], alen, "<<a>>");
+    benchCheckRow(&buf->row[2], blen, "<<b>>");
+    benchCheckRow(&buf->row[3], sizeof(tail) - 2, "last line");
+    benchReport(&open);
+
+    // insert past 2 GiB into a, remove the start of b and add a row at the end
+    benchResult edit = { "large_edit", 4, 0, 3, size, {0, 0}, {{0, 0, 0}} };
+    benchStart(&t);
+    editorRowInsertChar(buf, &buf->row[1], alen - 5, '#');
+    editorRowDeleteChar(buf, &buf->row[2], 0);
+    editorInsertRow(buf, 4, "added", 5);
+    benchStop(&t, &edit);
+    benchCheck(buf->numrows == 5, "rows after edit");
+    benchCheckRow(&buf->row[1], alen + 1, "#<<a>>");
+    benchCheckRow(&buf->row[2], blen - 1, "<<b>>");
+    benchReport(&edit);
+
+    // the end of a is scrolled to, so the columns on screen are past 2 GiB
+    appendBuffer ab = ABUF_INIT;
+    benchResult draw = { "large_draw", 5, 0, 1, 0, {0, 0}, {{0, 0, 0}} };
+    benchStart(&t);
+    v->cy = 1;
+    v->cx = buf->row[1].size;
+    editorScroll(v);
+    editorDrawRows(v, &ab);
+    benchStop(&t, &draw);
+    draw.bytes = ab.len;
+    benchCheck(v->coloff > alen - v->screencols, "scrolled to the end of the long line");
+    benchCheck(memmem(ab.buf, ab.len, "#<<a>>", 6) != NULL, "end of the long line drawn");
+    abFree(&ab);
+    benchReport(&draw);
+
+    benchResult save = { "large_save", 5, 0, 5, size + 6, {0, 0}, {{0, 0, 0}} };
+    free(buf->filename);
+    buf->filename = strdup(dst);
+    benchStart(&t);
+    editorSave(buf);
+    benchStop(&t, &save);
+    struct stat st;
+    benchCheck(stat(dst, &st) == 0 && st.st_size == size + 6, "saved size");
+    benchCheckFile(dst, boff - 6, "#<<a>>\n");
+    benchCheckFile(dst, boff + blen - 5, "<<b>>\nlast line\nadded\n");
+    benchReport(&save);
+
+    // saving left a line cache behind, whose offsets past 4 GiB are read back
+    benchResult reopen = { "large_reopen", 5, 0, 5, size + 6, {0, 0}, {{0, 0, 0}} };
+    benchStart(&t);
+    editorOpen(buf, dst);
+    benchStop(&t, &reopen);
+    benchCheck(buf->numrows == 5, "rows after reopen");
+    benchCheckRow(&buf->row[1], alen + 1, "#<<a>>");
+    benchCheckRow(&buf->row[2], blen - 1, "<<b>>");
+    benchCheckRow(&buf->row[4], 5, "added");
+    benchReport(&reopen);
+
+    editorFreeRows(buf);
+    char cache[PATH_MAX];
+    if (cachePath(src, cache, sizeof(cache)) == 0) unlink(cache);
+    if (cachePath(dst, cache, sizeof(cache)) == 0) unlink(cache);
+    unlink(src);
+    unlink(dst);
+}
+
+/* KEY CHECKS */
+// Feeds keys through editorProcessKeyPress as a replay would, stopping once
+// they are used up rather than at the end of the input.
+void benchKeys(const char *keys) {
+    int fds[2];
+    if (pipe(fds) == -1) die("pipe");
+    if (write(fds[1], keys, strlen(keys)) != (ssize_t)strlen(keys)) die("write");
+
+    int infd = E.infd;
+    E.infd = fds[0];
+    E.replay.active = 1; // keeps the clipboard off the terminal
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    while (poll(&pfd, 1, 0) > 0) editorProcessKeyPress();
+    E.replay.active = 0;
+    E.infd = infd;
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void benchCheckRows(editorBuffer *buf, const char *expect, const char *what) {
+    const char *p = expect;
+    for (ssize_t i = 0; i < buf->numrows; i++) {
+        const char *nl = strchr(p, '\n');
+        benchCheck(nl != NULL && nl - p == buf->row[i].size && !memcmp(p, buf->row[i].chars, nl - p), what);
+        p = nl + 1;
+    }
+    benchCheck(*p == '\0', what);
+}
+
+// Cutting a line out of the middle and yanking it back, elsewhere and again.
+void benchClipboard(void) {
+    editorBuffer *buf = E.view->buf;
+    editorInsertRow(buf, 0, "one", 3);
+    editorInsertRow(buf, 1, "two", 3);
+    editorInsertRow(buf, 2, "three", 5);
+
+    char *three = buf->row[2].chars;
+    benchKeys("\x1b[B\x18");
+    benchCheckRows(buf, "one\nthree\n", "cut a middle line");
+    benchCheck(buf->row[1].chars == three, "cut a middle line without copying the next one");
+    benchKeys("\x16");
+    benchCheckRows(buf, "one\ntwo\nthree\n", "yank a cut middle line back");
+    benchKeys("\x1b[B\x16");
+    benchCheckRows(buf, "one\ntwo\nthree\ntwo\n", "yank a cut middle line at the end");
+    benchKeys("\x1b[A\x1b[A\x1b[A\x1b[A\x18\x16\x19");
+    benchCheckRows(buf, "two\ntwo\nthree\ntwo\n", "yank an older cut over a newer one");
+
+    editorFreeRows(buf);
+    while (E.clip.num > 0) clipEntryFree(&E.clip.entries[--E.clip.num]);
+    E.view->cy = E.view->cx = 0;
+}
+
+int main(int argc, char *argv[]) {
+    static long long defaults[] = { 1000, 10000, 100000, 1000000, 10000000 };
+    int nsizes = sizeof(defaults) / sizeof(defaults[0]);
+
+    char dir[] = "/tmp/kilo-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) die("mkdtemp");
+
+    char src[64], dst[64], cache[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/input.c", dir);
+    snprintf(dst, sizeof(dst), "%s/output.c", dir);
+
+    // keep line caches out of the user's cache directory
+    setenv("XDG_CACHE_HOME", dir, 1);
+
+    benchSetup();
+    benchClipboard();
+
+    // --large [LINE_MB [FILE_MB]] replaces the usual runs
+    int large = argc > 1 && !strcmp(argv[1], "--large");
+    if (large) {
+        size_t linemb = argc > 2 ? strtoull(argv[2], NULL, 10) : BENCH_LARGE_LINE_MB;
+        size_t filemb = argc > 3 ? strtoull(argv[3], NULL, 10) : BENCH_LARGE_FILE_MB;
+        benchLarge(dir, linemb, filemb);
+    }
+
+    for (int i = 0; !large && i < (argc > 1 ? argc - 1 : nsizes); i++) {
+        long long lines = argc > 1 ? atoll(argv[i + 1]) : defaults[i];
+        if (lines <= 0) continue;
+
+        size_t bytes = benchGenerate(src, lines);
+        benchOpen(src, lines, bytes);
+        benchReopen(src, lines, bytes);
+        benchSyntax(lines);
+        benchFind(lines);
+        benchDraw(lines);
+        benchSave(dst, lines);
+
+        editorFreeRows(E.view->buf);
+    }
+
+    if (cachePath(src, cache, sizeof(cache)) == 0) unlink(cache);
+    if (cachePath(dst, cache, sizeof(cache)) == 0) unlink(cache);
+    snprintf(cache, sizeof(cache), "%s/kilo", dir);
+    rmdir(cache);
+    unlink(src);
+    unlink(dst);
+    rmdir(dir);
+
+    return 0;
+}
@@ -2,14 +2,47 @@
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
 #define CTRL_KEY(k) ((k) & 0x1f) // Ctrl + [A-Z] map to bytes 1-26
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0, MEM_FRAME}
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+#define KILO_MAX_VIEWS 8
+#define KILO_GUTTER 1 // columns left of the text for the diff marks
+#define UNICODE_INVALID 0xFFFFFFFFu
+#define ROW_MARK_STEP 1024 // bytes of chars between the width marks of a long row
+#define KILO_CACHE_MIN_BYTES (1024 * 1024) // smaller files load fast enough without a line cache
+#define CACHE_MAGIC "KILOIDX1"
+#define REPLAY_ROWS 24
+#define REPLAY_COLS 80
+#define PERF_SUB_BITS 4
+#define PERF_SUB_BUCKETS (1 << PERF_SUB_BITS)
+#define PERF_BUCKETS ((64 - PERF_SUB_BITS) * PERF_SUB_BUCKETS)
+#define STORE_MIN_BLOCK 16
+#define STORE_SMALL_BLOCK 256 // classes step by STORE_MIN_BLOCK up to here, then by a quarter power of two
+#define STORE_CLASSES 44 // size classes 16 B .. 32 KiB, larger blocks come from malloc
+#define STORE_MAX_BLOCK (32 * 1024)
+#define STORE_ALIGN 8 // exact blocks stay aligned for the free list pointer
+#define STORE_CHUNK_MIN (64 * 1024)
+#define STORE_CHUNK_MAX (64 * 1024 * 1024)
+#define STREAM_CHUNK (64 * 1024) // decompressed bytes appended per poll, small enough to keep keys responsive
+#define STREAM_POLL_MS 100
+#define SAVE_CHUNK (64 * 1024) // rows are gathered into writes of this size instead of copying the whole file
+#define KILO_UNDO_STEPS 32
+#define KILO_KILL_RING 8
+#define CLIP_OSC52_MAX (64 * 1024) // larger selections stay out of the terminal clipboard
+#define DIFF_MAX_EDITS 1024 // past this many line edits the changed span is marked as a whole
+#define DIFF_INLINE_ROWS 256 // spans this small are diffed during the frame instead of on the worker
+#define SORT_MAX_THREADS 64
+#define GREP_MAX_THREADS 64
+#define GREP_MAX_LINE 1024 // bytes of a matching line shown in the results
+#define GREP_MAX_HITS 1000000 // the search stops here rather than fill memory
+#define SORT_PARALLEL_MIN (64 * 1024) // smaller ranges sort faster than threads start
+#define COMPRESSORS_ENTRIES (sizeof(COMPRESSORS) / sizeof(COMPRESSORS[0]))
 
 /* INCLUDES */
 #include <unistd.h>
@@ -25,23 +58,112 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <wordexp.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <regex.h>
+#include <malloc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* DATA */
+typedef struct rowMark {
+    ssize_t cx;
+    ssize_t roff; // where the same character starts in render
+    ssize_t rx;
+} rowMark;
+
+// Kept for rows whose columns aren't their bytes, unless they're short ASCII:
+// the marks let cursor and drawing math start near the column they want
+// instead of decoding the row from its first byte.
+typedef struct rowLayout {
+    ssize_t width; // display columns of the whole row
+    rowMark marks[]; // one per ROW_MARK_STEP bytes of chars, then the grapheme bitmap of a non-ASCII row
+} rowLayout;
+
 typedef struct editorRow {
-    int idx;
-    int size;
-    int rsize;
+    ssize_t idx;
+    ssize_t size;
+    ssize_t rsize;
+    size_t capacity; // bytes reserved for chars
+    size_t hlcapacity;
     char *chars;
-    char *render;
+    char *render; // aliases chars unless ownrender, then a sized store block
     unsigned char *hl;
-    int hlOpenComment;
+    rowLayout *layout; // as a sized store block, NULL for ASCII rows that are short or have no tabs
+    unsigned char ownrender;
+    unsigned char ascii;
+    unsigned char shared; // a kill ring entry points into chars
+    unsigned char hlOpenComment;
+    unsigned char hlStale; // hl not computed yet, hlOpenComment came from the line cache
 } editorRow;
 
+typedef struct unicodeWidthRange {
+    unsigned int first;
+    unsigned int last;
+    int width;
+} unicodeWidthRange;
+
+typedef struct lineCacheHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t numrows;
+    uint64_t pathlen;
+} lineCacheHeader;
+
+enum memTag {
+    MEM_TEXT = 0, // row text, the row array, the kill ring and other editing state
+    MEM_RENDER, // tab-expanded render buffers and grapheme bitmaps
+    MEM_HIGHLIGHT,
+    MEM_SEARCH,
+    MEM_UNDO,
+    MEM_DIFF,
+    MEM_FRAME,
+    MEM_STORE, // row store chunk space not handed out as blocks
+    MEM_TAGS
+};
+
+typedef struct memCounter {
+    long long live;
+    long long peak;
+    unsigned long long allocs;
+} memCounter;
+
 typedef struct appendBuffer {
     char *buf;
-    int len;
+    size_t len;
+    size_t cap;
+    int tag; // enum memTag the buffer is counted under
 } appendBuffer;
 
+typedef struct storeChunk {
+    struct storeChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} storeChunk;
+
+typedef struct rowStore {
+    storeChunk *chunks;
+    void *freelist[STORE_CLASSES];
+    size_t nextChunkSize;
+    int exact; // a file is loading, hand out blocks at their exact size
+    long long live[MEM_TAGS]; // block bytes handed out per tag, returned all at once by storeReset
+    size_t chunkBytes;
+    size_t freeBytes; // in blocks on the free lists
+} rowStore;
+
 typedef struct editorSyntax {
     char *filetype;
     char **filematch;
@@ -52,21 +174,262 @@ typedef struct editorSyntax {
     int flags;
 } editorSyntax;
 
-typedef struct editorConfig {
-    int cx;
-    int cy;
-    int rx;
-    int rowoff;
-    int coloff;
-    int screenrows;
-    int screencols;
-    int numrows;
+typedef struct undoStep {
+    ssize_t start;
+    ssize_t numrows; // rows the operation left in the range
+    ssize_t *order; // position in the original range of each of those rows
+    editorRow *dropped; // rows the operation removed, still allocated for undo
+    ssize_t *droppedAt;
+    ssize_t numdropped;
+    unsigned long long before; // buffer version before the operation
+    unsigned long long after;
+} undoStep;
+
+typedef struct lineSortField {
+    const char *key;
+    ssize_t keylen;
+} lineSortField;
+
+typedef struct lineSortOptions {
+    int numeric;
+    int reverse;
+    int column; // 1-based field to sort on, 0 for the whole line
+    int delim; // field separator, 0 for runs of blanks
+    editorRow *rows; // the range being sorted
+    lineSortField *fields; // key of each row in the range
+    ssize_t skip; // bytes every key starts with
+} lineSortOptions;
+
+// Small enough for the merge passes to move cheaply, with enough of the key
+// inline that most compares never touch the row.
+typedef struct lineSortKey {
+    uint64_t prefix[2]; // key bytes after the common prefix big-endian, or the number
+    ssize_t pos; // position in the range before sorting
+} lineSortKey;
+
+enum lineSortPhase {
+    SORT_FIELDS = 0, // find the keys of lo..hi and their common prefix
+    SORT_SLICE, // sort lo..hi
+    SORT_MERGE // merge lo..mid with mid..hi
+};
+
+typedef struct lineSortJob {
+    lineSortKey *keys;
+    lineSortKey *tmp;
+    ssize_t lo;
+    ssize_t mid;
+    ssize_t hi;
+    ssize_t common;
+    int phase;
+    lineSortOptions *opt;
+} lineSortJob;
+
+enum diffMark {
+    DIFF_NONE = 0,
+    DIFF_ADDED,
+    DIFF_MODIFIED,
+    DIFF_KIND = 3, // the bits above, the ones below can be set on any row
+    DIFF_DELETED = 4, // lines were deleted just above this row
+    DIFF_DELETED_BELOW = 8 // lines were deleted after this row, the last one
+};
+
+typedef struct diffState {
+    uint64_t *base; // line hashes of the file as last opened or saved, NULL for no file
+    ssize_t numbase;
+    ssize_t basecap;
+    ssize_t *origin; // per row, the saved line it matched in the last diff or -1
+    unsigned char *marks; // enum diffMark bits per row
+    ssize_t cap; // rows origin and marks have room for
+    int dirty; // rows lo..hi changed since they were diffed, lo == hi for deletions only
+    ssize_t lo;
+    ssize_t hi;
+    int loading; // rows are appended as lines of the file, not as edits
+    int running;
+    int stale; // rows were inserted or deleted inside the window while it was diffed
+    int wakefd[2]; // the worker writes a byte here when it is done
+    pthread_t thread;
+    ssize_t winlo; // rows the worker is diffing, kept in step with inserts and deletes
+    ssize_t winhi;
+    ssize_t winbase; // first saved line they are diffed against
+    ssize_t numwinbase;
+    uint64_t *cur; // hashes of the window rows as they were when it started
+    ssize_t numcur;
+    ssize_t *curorigin; // what the worker found, relative to winbase
+    unsigned char *result; // one more than the rows, for deletions after the last
+    ssize_t curcap;
+} diffState;
+
+typedef struct editorBuffer {
+    ssize_t numrows;
+    ssize_t rowcap;
     editorRow *row;
+    rowStore store;
     int dirty;
+    unsigned long long version; // bumped by every row change
+    undoStep undo[KILO_UNDO_STEPS];
+    int numundo;
+    int deferHighlight;
     char *filename;
+    editorSyntax *syntax;
+    int streamfd; // decompressor output still being read, -1 once the file is fully loaded
+    pid_t streampid;
+    char *pending; // partial last line of the decompressed stream
+    size_t pendinglen;
+    size_t pendingcap;
+    pid_t savepid; // background compressor writing the file, 0 when idle
+    int saveDirty; // dirty count when the background save started
+    diffState diff;
+    int grep; // holds project search results, Enter opens the one under the cursor
+    int memReport; // holds the memory report, rebuilt on every Ctrl-T
+} editorBuffer;
+
+typedef struct lineFilter {
+    char *query; // NULL while the view shows every row
+    size_t querylen;
+    ssize_t *rows; // matching row numbers in ascending order
+    ssize_t numrows;
+    ssize_t cap;
+    ssize_t kept; // listed only while the cursor is on it, or -1
+} lineFilter;
+
+typedef struct editorCursor {
+    ssize_t y;
+    ssize_t x;
+} editorCursor;
+
+typedef struct cursorSet {
+    editorCursor *at; // extra cursors besides the view's own, sorted by row and column
+    ssize_t num;
+    ssize_t cap;
+    int block; // the next edit first deletes from blockrx to each cursor
+    ssize_t blockrx;
+} cursorSet;
+
+typedef struct editorView {
+    editorBuffer *buf;
+    ssize_t cx;
+    ssize_t cy;
+    ssize_t rx;
+    ssize_t rowoff;
+    ssize_t coloff;
+    int top;
+    int screenrows;
+    int screencols;
+    int marked;
+    ssize_t markx;
+    ssize_t marky;
+    lineFilter filter;
+    cursorSet multi;
+} editorView;
+
+typedef struct editorCompressor {
+    char *suffix;
+    unsigned char magic[4];
+    int magiclen;
+    char **decompress;
+    char **compress;
+} editorCompressor;
+
+enum perfStage {
+    PERF_PROCESS = 0,
+    PERF_HIGHLIGHT,
+    PERF_FRAME,
+    PERF_WRITE,
+    PERF_TOTAL,
+    PERF_STAGES
+};
+
+typedef struct perfHistogram {
+    unsigned long long counts[PERF_BUCKETS];
+    unsigned long long total;
+    long long max;
+} perfHistogram;
+
+typedef struct editorPerf {
+    int enabled;
+    int overlay;
+    int pending; // a key was read and its frame has not been written yet
+    long long keyStart;
+    long long highlightNanos;
+    perfHistogram stages[PERF_STAGES];
+} editorPerf;
+
+typedef struct editorReplay {
+    int active;
+    int fd;
+    long long start;
+    unsigned long long keys;
+    unsigned long long frames;
+    unsigned long long bytes;
+} editorReplay;
+
+typedef struct clipSpan {
+    char *s;
+    ssize_t len;
+    size_t cap; // s is a store block the entry owns, 0 when it points into other text
+} clipSpan;
+
+typedef struct clipEntry {
+    editorBuffer *buf; // the spans point into this buffer's rows and store, NULL once copied out
+    clipSpan *spans; // one per line
+    ssize_t numspans;
+    char *text; // holds the lines once copied out
+    size_t bytes; // including the newlines between lines
+} clipEntry;
+
+typedef struct clipRing {
+    clipEntry entries[KILO_KILL_RING]; // oldest first
+    int num;
+    int yank; // entry the last paste came from
+    editorBuffer *yankBuf; // where the last paste went, so Ctrl-Y can replace it
+    unsigned long long yankVersion;
+    ssize_t yanky;
+    ssize_t yankx;
+    ssize_t yankendy;
+    ssize_t yankendx;
+} clipRing;
+
+typedef struct grepSearch {
+    char *query;
+    size_t querylen;
+    int regex;
+    editorBuffer *buf; // the results buffer
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t ready; // files were queued, the walk ended or the search is stopping
+    char **files; // paths found so far, the workers take them in order
+    ssize_t numfiles;
+    ssize_t filecap;
+    ssize_t nextfile;
+    int walking;
+    int stop;
+    int workers; // still running
+    appendBuffer hits; // result lines the UI has not appended yet
+    unsigned long long numhits;
+    unsigned long long scanned;
+    unsigned long long bytes;
+    pthread_t walker;
+    pthread_t threads[GREP_MAX_THREADS];
+    int numthreads;
+    int wakefd[2]; // workers write a byte here when they hand over hits or finish
+    long long start;
+} grepSearch;
+
+typedef struct editorConfig {
+    int screenrows;
+    int screencols;
+    editorBuffer **buffers;
+    int numbuffers;
+    editorView views[KILO_MAX_VIEWS];
+    int numviews;
+    editorView *view;
     char statusmsg[80];
     time_t statusmsgTime;
-    editorSyntax *syntax;
+    editorPerf perf;
+    editorReplay replay;
+    clipRing clip;
+    grepSearch *grep; // the running project search, NULL when none
+    memCounter mem[MEM_TAGS];
+    int infd;
     struct termios origTermios;
 } editorConfig;
 
@@ -116,11 +479,60 @@ editorSyntax HLDB[] = {
     },
 };
 
+char *MEM_TAG_NAMES[MEM_TAGS] = { "text", "render", "highlight", "search", "undo", "diff", "frame", "store" };
+
+char *GZIP_DECOMPRESS[] = { "gzip", "-dc", NULL };
+char *GZIP_COMPRESS[] = { "gzip", "-c", NULL };
+char *ZSTD_DECOMPRESS[] = { "zstd", "-dcq", NULL };
+char *ZSTD_COMPRESS[] = { "zstd", "-cq", NULL };
+
+editorCompressor COMPRESSORS[] = {
+    { ".gz", { 0x1f, 0x8b }, 2, GZIP_DECOMPRESS, GZIP_COMPRESS },
+    { ".zst", { 0x28, 0xb5, 0x2f, 0xfd }, 4, ZSTD_DECOMPRESS, ZSTD_COMPRESS },
+};
+
 /* PROTOTYPES */
+// memory accounting
+void memShift(int tag, long long delta);
+void memCount(int tag, long long delta);
+void *memMalloc(int tag, size_t n);
+void *memCalloc(int tag, size_t nmemb, size_t n);
+void *memRealloc(int tag, void *p, size_t n);
+void memFree(int tag, void *p);
+void memResetPeaks(void);
+int memFormat(char *out, size_t outlen, long long bytes);
+void editorMemoryReport(void);
+
 // append buffer
-void abAppend(appendBuffer *ab, const char *s, int len);
+void abAppend(appendBuffer *ab, const char *s, size_t len);
 void abFree(appendBuffer *ab);
 
+// row storage
+int storeClass(size_t n);
+size_t storeClassSize(int cls);
+void *storeAlloc(rowStore *st, int tag, size_t n, size_t *cap);
+void storeFree(rowStore *st, int tag, void *p, size_t cap);
+void *storeReserve(rowStore *st, int tag, void *p, size_t *cap, size_t used, size_t need);
+void *storeAllocSized(rowStore *st, int tag, size_t n);
+size_t storeSizedCap(void *p);
+void storeFreeSized(rowStore *st, int tag, void *p);
+void storeReset(rowStore *st);
+
+// performance
+long long perfNow(void);
+int perfBucket(long long ns);
+long long perfBucketValue(int bucket);
+void perfRecord(int stage, long long ns);
+long long perfPercentile(int stage, double pct);
+void perfKeyStart(void);
+void perfToggleOverlay(void);
+void perfDrawOverlay(appendBuffer *ab);
+void perfDump(void);
+
+// replay
+void replayStart(char *path, char *size);
+void replayFinish(void);
+
 // terminal
 void die(const char *s);
 void disableRawMode(void);
@@ -129,65 +541,625 @@ int editorReadKey(void);
 int getCursorPosition(int *rows, int *cols);
 int getWindowSize(int *rows, int *cols);
 
+// unicode
+int unicodeDecode(const char *s, ssize_t len, unsigned int *cp);
+int unicodeWidth(unsigned int cp);
+int unicodeScan(const char *s, ssize_t len, ssize_t *tabs);
+
 // syntax highlighting
 int isSeparator(int c);
-void editorUpdateSyntax(editorRow *row);
+void editorUpdateSyntax(editorBuffer *buf, editorRow *row);
+void editorHighlightRow(editorBuffer *buf, editorRow *row);
+void editorHighlightRows(editorBuffer *buf, ssize_t start, ssize_t n);
 int editorSyntaxToColour(int hl);
-void editorSelectSyntaxHighlight(void);
+void editorSelectSyntaxHighlight(editorBuffer *buf);
 
 // row operations
-int editorRowCxToRx(editorRow *row, int cx);
-int editorRowRxToCx(editorRow *row, int rx);
-void editorUpdateRow(editorRow *row);
-void editorInsertRow(int pos, char *s, size_t len);
-void editorFreeRow(editorRow *row);
-void editorDeleteRow(int pos);
-void editorRowInsertChar(editorRow *row, int pos, int c);
-void editorRowAppendString(editorRow *row, char *s, size_t len);
-void editorRowDeleteChar(editorRow *row, int pos);
+ssize_t editorRowCxToRx(editorRow *row, ssize_t cx);
+ssize_t editorRowRxToCx(editorRow *row, ssize_t rx);
+ssize_t editorRowRenderToRx(editorRow *row, ssize_t roff);
+rowMark *editorRowMark(editorRow *row, ssize_t cx, ssize_t rx);
+unsigned char *editorRowClusters(editorRow *row);
+int editorRowIsClusterStart(editorRow *row, ssize_t cx);
+ssize_t editorRowPrevCluster(editorRow *row, ssize_t cx);
+ssize_t editorRowNextCluster(editorRow *row, ssize_t cx);
+void editorUpdateLayout(editorBuffer *buf, editorRow *row);
+void editorFreeRender(editorBuffer *buf, editorRow *row);
+void editorUpdateRow(editorBuffer *buf, editorRow *row);
+void editorOpenRows(editorBuffer *buf, ssize_t pos, ssize_t n);
+void editorSetRow(editorBuffer *buf, ssize_t pos, char *s, size_t len);
+void editorInsertRow(editorBuffer *buf, ssize_t pos, char *s, size_t len);
+void editorFreeRow(editorBuffer *buf, editorRow *row);
+void editorFreeRows(editorBuffer *buf);
+void editorDeleteRows(editorBuffer *buf, ssize_t pos, ssize_t n);
+void editorDeleteRow(editorBuffer *buf, ssize_t pos);
+void editorRowInsertChar(editorBuffer *buf, editorRow *row, ssize_t pos, int c);
+void editorRowAppendString(editorBuffer *buf, editorRow *row, char *s, size_t len);
+void editorRowDeleteChar(editorBuffer *buf, editorRow *row, ssize_t pos);
 
 // editor operations
-void editorInsertChar(int c);
-void editorInsertNewLine(void);
-void editorDeleteChar(void);
+void editorInsertChar(editorView *v, int c);
+void editorInsertNewLine(editorView *v);
+void editorDeleteChar(editorView *v);
+
+// line operations
+void editorMarkedRows(editorView *v, ssize_t *start, ssize_t *end);
+void lineSortFieldFor(lineSortOptions *opt, ssize_t pos);
+ssize_t lineCommonPrefix(lineSortField *a, lineSortField *b);
+void lineSortKeyFor(lineSortKey *k, ssize_t pos, lineSortOptions *opt);
+int lineCompare(lineSortKey *a, lineSortKey *b, lineSortOptions *opt);
+void lineSortRange(lineSortKey *keys, lineSortKey *tmp, ssize_t n, lineSortOptions *opt);
+void lineMerge(lineSortKey *keys, lineSortKey *tmp, ssize_t lo, ssize_t mid, ssize_t hi, lineSortOptions *opt);
+void *lineSortWorker(void *arg);
+void lineSortRun(lineSortJob *jobs, int njobs);
+void lineSortParallel(lineSortKey *keys, ssize_t n, lineSortOptions *opt);
+undoStep *undoPush(editorBuffer *buf, ssize_t start, ssize_t numrows);
+void undoDiscard(editorBuffer *buf, undoStep *step);
+void undoClear(editorBuffer *buf);
+void editorRowsMoved(editorBuffer *buf, ssize_t start, ssize_t n);
+void editorSortRows(editorBuffer *buf, ssize_t start, ssize_t end, lineSortOptions *opt);
+void editorUniqueRows(editorBuffer *buf, ssize_t start, ssize_t end);
+void editorReverseRows(editorBuffer *buf, ssize_t start, ssize_t end);
+void editorUndo(editorBuffer *buf);
+void editorLineCommand(void);
+
+// clipboard
+void clipEntryFree(clipEntry *e);
+void clipCopyOut(clipEntry *e);
+void clipRelease(editorBuffer *buf, editorRow *row);
+clipEntry *clipPush(editorBuffer *buf, ssize_t numspans);
+int clipSelection(editorView *v, ssize_t *y0, ssize_t *x0, ssize_t *y1, ssize_t *x1);
+void clipCollect(editorBuffer *buf, clipEntry *e, ssize_t y0, ssize_t x0, ssize_t y1, ssize_t x1);
+void clipKeep(editorBuffer *buf, clipSpan *span, char *s, ssize_t len);
+void clipTake(clipSpan *span, editorRow *row, ssize_t len);
+void clipRemove(editorBuffer *buf, clipEntry *e, ssize_t y0, ssize_t x0, ssize_t y1, ssize_t x1);
+void clipInsert(editorBuffer *buf, clipEntry *e, ssize_t y, ssize_t x, ssize_t *endy, ssize_t *endx);
+void clipOsc52(clipEntry *e);
+void clipYank(editorView *v);
+void editorCopy(editorView *v);
+void editorCut(editorView *v);
+void editorPaste(editorView *v);
+void editorYankPop(editorView *v);
+
+// multiple cursors
+int cursorCompare(const void *a, const void *b);
+void cursorsClear(editorView *v);
+void cursorsAdd(editorView *v, ssize_t y, ssize_t x);
+void cursorsSort(editorView *v);
+void cursorsClamp(editorView *v);
+ssize_t cursorsFind(editorView *v, ssize_t y);
+ssize_t cursorsRx(editorView *v, editorRow *row, ssize_t *k);
+void cursorsMove(editorView *v, int key);
+void cursorsEditRow(editorBuffer *buf, editorRow *row, editorCursor *at, ssize_t *cut, ssize_t n, int key);
+void cursorsEdit(editorView *v, int key);
+void editorAddCursorBelow(editorView *v);
+void editorBlockCursors(editorView *v);
+int editorCursorsKey(editorView *v, int c);
+
+// buffers and views
+editorBuffer *editorNewBuffer(void);
+editorBuffer *editorFindBuffer(char *filename);
+void editorShowBuffer(editorView *v, editorBuffer *buf);
+void editorLayoutViews(void);
+void editorSplitView(void);
+void editorCloseView(void);
+void editorNextView(void);
+void editorNextBuffer(void);
+
+// line cache
+int cachePath(const char *filename, char *out, size_t outlen);
+int cacheLoad(editorBuffer *buf, const char *filename);
+void cacheStore(editorBuffer *buf, const char *filename, const uint64_t *offsets);
+
+// compressed files
+editorCompressor *compressorForFile(const char *filename);
+editorCompressor *compressorForName(const char *filename);
+pid_t compressorSpawn(char **argv, int infd, int outfd);
+void streamOpen(editorBuffer *buf, editorCompressor *c);
+ssize_t streamRead(editorBuffer *buf);
+int streamClose(editorBuffer *buf);
+int streamCompress(editorBuffer *buf, editorCompressor *c);
+void streamSave(editorBuffer *buf, editorCompressor *c);
+int streamReap(void);
+
+// diff gutter
+uint64_t diffHash(const char *s, ssize_t len);
+void diffReserve(editorBuffer *buf, ssize_t rows);
+void diffTouch(diffState *d, ssize_t lo, ssize_t hi);
+void diffRowsInserted(editorBuffer *buf, ssize_t pos, ssize_t n);
+void diffRowsDeleted(editorBuffer *buf, ssize_t pos, ssize_t n);
+void diffRowUpdated(editorBuffer *buf, editorRow *row);
+void diffJoin(editorBuffer *buf);
+void diffReset(editorBuffer *buf);
+void diffSetBase(editorBuffer *buf);
+void diffAppendBase(editorBuffer *buf, ssize_t from);
+void diffMarkSpan(unsigned char *marks, ssize_t at, ssize_t deleted, ssize_t inserted);
+int diffMyers(const uint64_t *a, ssize_t n, const uint64_t *b, ssize_t m, unsigned char *marks, ssize_t *origin, ssize_t aoff);
+void diffCompute(const uint64_t *a, ssize_t n, const uint64_t *b, ssize_t m, unsigned char *marks, ssize_t *origin);
+void *diffWorker(void *arg);
+void diffUpdate(editorBuffer *buf);
+void diffDrawGutter(editorBuffer *buf, editorRow *row, appendBuffer *ab);
+
+// background work
+int backgroundBusy(void);
+void backgroundWait(void);
 
 // file i/o
-char *editorRowsToString(int *buflen);
-void editorOpen(char *filename);
-void editorSave(void);
+size_t editorRowsLength(editorBuffer *buf);
+int editorWriteAll(int fd, const char *s, size_t len);
+int editorWriteRows(editorBuffer *buf, int fd, char *chunk);
+void editorOpen(editorBuffer *buf, char *filename);
+void editorOpenPrompt(void);
+void editorSave(editorBuffer *buf);
 
 // find
 void editorFindCallback(char *callback, int key);
 void editorFind(void);
 
+// filter
+ssize_t filterLines(editorView *v);
+ssize_t filterRow(editorView *v, ssize_t line);
+ssize_t filterLine(editorView *v, ssize_t cy);
+int filterMatch(lineFilter *f, editorRow *row);
+void filterInsert(lineFilter *f, ssize_t line, ssize_t row);
+void filterRemove(lineFilter *f, ssize_t line);
+void filterSet(editorView *v, char *query);
+void filterScan(editorView *v);
+void filterRefresh(editorBuffer *buf);
+void filterRowsInserted(editorBuffer *buf, ssize_t pos, ssize_t n);
+void filterRowsDeleted(editorBuffer *buf, ssize_t pos, ssize_t n);
+void filterRowUpdated(editorBuffer *buf, editorRow *row);
+void filterRowsFreed(editorBuffer *buf);
+void filterFollow(editorView *v);
+void editorFilter(void);
+
+// project search
+const char *grepFind(const char *s, size_t len, const char *needle, size_t n);
+size_t grepCountLines(const char *s, size_t len);
+unsigned long long grepScan(grepSearch *g, regex_t *re, const char *path, const char *s, size_t len, appendBuffer *out);
+void grepFile(grepSearch *g, regex_t *re, char *path, appendBuffer *out);
+int grepQueue(grepSearch *g, char *path);
+void *grepWalker(void *arg);
+void *grepWorker(void *arg);
+void grepStop(void);
+int grepDrain(void);
+void grepStart(char *query);
+void editorGrep(void);
+void editorGrepOpen(editorView *v);
+
 // output
-void editorScroll(void);
-void editorDrawRows(appendBuffer *ab);
-void editorDrawStatusBar(appendBuffer *ab);
+void editorScroll(editorView *v);
+void editorDrawRows(editorView *v, appendBuffer *ab);
+void editorDrawStatusBar(editorView *v, appendBuffer *ab);
 void editorDrawMessageBar(appendBuffer *ab);
 void editorRefreshScreen(void);
 void editorSetStatusMessage(const char *fmt, ...);
 
 // input
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
-void editorMoveCursor(int key);
+void editorMoveCursor(editorView *v, int key);
+int editorUnsavedBuffers(void);
 void editorProcessKeyPress(void);
 
 // init
 void initEditor(void);
 
+/* MEMORY ACCOUNTING */
+// Allocations are counted per subsystem: the malloc wrappers below by the
+// usable size malloc really reserved, the row store by the size of the blocks
+// it hands out. Worker threads allocate too, so the counters are atomic.
+
+// Moves live bytes to or from a tag without counting an allocation.
+void memShift(int tag, long long delta) {
+    memCounter *m = &E.mem[tag];
+    long long live = __atomic_add_fetch(&m->live, delta, __ATOMIC_RELAXED);
+    if (delta <= 0) return;
+
+    long long peak = __atomic_load_n(&m->peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&m->peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void memCount(int tag, long long delta) {
+    memShift(tag, delta);
+    if (delta > 0) __atomic_add_fetch(&E.mem[tag].allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *memMalloc(int tag, size_t n) {
+    void *p = malloc(n);
+    if (p) memCount(tag, malloc_usable_size(p));
+
+    return p;
+}
+
+void *memCalloc(int tag, size_t nmemb, size_t n) {
+    void *p = calloc(nmemb, n);
+    if (p) memCount(tag, malloc_usable_size(p));
+
+    return p;
+}
+
+void *memRealloc(int tag, void *p, size_t n) {
+    size_t old = p ? malloc_usable_size(p) : 0;
+    void *new = realloc(p, n);
+    if (new) memCount(tag, (long long)malloc_usable_size(new) - (long long)old);
+
+    return new;
+}
+
+void memFree(int tag, void *p) {
+    if (p == NULL) return;
+    memCount(tag, -(long long)malloc_usable_size(p));
+    free(p);
+}
+
+void memResetPeaks(void) {
+    for (int i = 0; i < MEM_TAGS; i++)
+        __atomic_store_n(&E.mem[i].peak, __atomic_load_n(&E.mem[i].live, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+int memFormat(char *out, size_t outlen, long long bytes) {
+    if (bytes >= 1024LL * 1024 * 1024) return snprintf(out, outlen, "%.2f GB", bytes / (1024.0 * 1024 * 1024));
+    if (bytes >= 1024 * 1024) return snprintf(out, outlen, "%.1f MB", bytes / (1024.0 * 1024));
+    if (bytes >= 1024) return snprintf(out, outlen, "%.1f KB", bytes / 1024.0);
+
+    return snprintf(out, outlen, "%lld B", bytes);
+}
+
+// Ctrl-T: a table of live bytes, peak bytes and allocations per subsystem, and
+// how much of it each buffer's row store holds, in a buffer of its own.
+void editorMemoryReport(void) {
+    editorBuffer *buf = NULL;
+    for (int i = 0; i < E.numbuffers && buf == NULL; i++)
+        if (E.buffers[i]->memReport) buf = E.buffers[i];
+    if (buf == NULL) {
+        buf = editorNewBuffer();
+        buf->memReport = 1;
+    }
+    for (int i = 0; i < E.numviews; i++)
+        if (E.views[i].buf == buf) editorShowBuffer(&E.views[i], buf);
+    editorFreeRows(buf);
+
+    // snapshot first, so the report's own rows are not in it
+    memCounter mem[MEM_TAGS];
+    for (int i = 0; i < MEM_TAGS; i++) {
+        mem[i].live = __atomic_load_n(&E.mem[i].live, __ATOMIC_RELAXED);
+        mem[i].peak = __atomic_load_n(&E.mem[i].peak, __ATOMIC_RELAXED);
+        mem[i].allocs = __atomic_load_n(&E.mem[i].allocs, __ATOMIC_RELAXED);
+    }
+
+    char line[256], live[32], peak[32];
+    int len = snprintf(line, sizeof(line), "%-12s %12s %12s %14s", "subsystem", "live", "peak", "allocations");
+    editorInsertRow(buf, buf->numrows, line, len);
+    long long total = 0;
+    for (int i = 0; i < MEM_TAGS; i++) {
+        memFormat(live, sizeof(live), mem[i].live);
+        memFormat(peak, sizeof(peak), mem[i].peak);
+        len = snprintf(line, sizeof(line), "%-12s %12s %12s %14llu", MEM_TAG_NAMES[i], live, peak, mem[i].allocs);
+        editorInsertRow(buf, buf->numrows, line, len);
+        total += mem[i].live;
+    }
+    memFormat(live, sizeof(live), total);
+    len = snprintf(line, sizeof(line), "%-12s %12s", "total", live);
+    editorInsertRow(buf, buf->numrows, line, len);
+
+    editorInsertRow(buf, buf->numrows, "", 0);
+    len = snprintf(line, sizeof(line), "%-20s %10s %10s %10s %10s %10s", "buffer", "rows", "text", "render", "highlight", "unused");
+    editorInsertRow(buf, buf->numrows, line, len);
+    for (int i = 0; i < E.numbuffers; i++) {
+        editorBuffer *b = E.buffers[i];
+        if (b == buf) continue;
+
+        // chunk space not yet carved into blocks plus blocks waiting for reuse
+        size_t unused = b->store.freeBytes;
+        for (storeChunk *chunk = b->store.chunks; chunk; chunk = chunk->next) unused += chunk->size - chunk->used;
+        char text[32], render[32], hl[32], spare[32];
+        memFormat(text, sizeof(text), b->store.live[MEM_TEXT] + b->rowcap * sizeof(editorRow));
+        memFormat(render, sizeof(render), b->store.live[MEM_RENDER]);
+        memFormat(hl, sizeof(hl), b->store.live[MEM_HIGHLIGHT]);
+        memFormat(spare, sizeof(spare), unused);
+        len = snprintf(line, sizeof(line), "%-20.20s %10zd %10s %10s %10s %10s",
+                       b->filename ? b->filename : b->grep ? "[Grep]" : "[No Name]",
+                       b->numrows, text, render, hl, spare);
+        editorInsertRow(buf, buf->numrows, line, len);
+    }
+    buf->dirty = 0;
+    editorShowBuffer(E.view, buf);
+}
+
 /* APPEND BUFFER */
-void abAppend(appendBuffer *ab, const char *s, int len) {
-    char *new = realloc(ab->buf, ab->len + len);
+// Grows by doubling, so a frame of many small appends costs a few reallocs.
+void abAppend(appendBuffer *ab, const char *s, size_t len) {
+    if (ab->len + len > ab->cap) {
+        size_t cap = ab->cap ? ab->cap * 2 : 1024;
+        if (cap < ab->len + len) cap = ab->len + len;
+        char *new = memRealloc(ab->tag, ab->buf, cap);
+        if (new == NULL) return;
+        ab->buf = new;
+        ab->cap = cap;
+    }
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->buf = new;
+    memcpy(&ab->buf[ab->len], s, len);
     ab->len += len;
 }
 
 void abFree(appendBuffer *ab) {
-    free(ab->buf);
+    memFree(ab->tag, ab->buf);
+}
+
+/* ROW STORAGE */
+// Row buffers come from size classes carved out of large chunks: 16-byte steps
+// up to 256 bytes, then four classes per power of two, so a block wastes at
+// most a fifth of its size. Rows made by a file load are packed at their exact
+// size instead. Freed blocks go on a per-class free list and every chunk is
+// released at once by storeReset, so loading a file costs a few big
+// allocations, not one per row.
+int storeClass(size_t n) {
+    if (n <= STORE_SMALL_BLOCK) return n ? (n - 1) / STORE_MIN_BLOCK : 0;
+
+    int shift = 63 - __builtin_clzll(n - 1) - 2; // a quarter of the power of two above n
+    return STORE_SMALL_BLOCK / STORE_MIN_BLOCK + (shift - 6) * 4 + (int)((n - 1) >> shift) - 4;
+}
+
+size_t storeClassSize(int cls) {
+    int small = STORE_SMALL_BLOCK / STORE_MIN_BLOCK;
+    if (cls < small) return (size_t)(cls + 1) * STORE_MIN_BLOCK;
+
+    cls -= small;
+    return (size_t)(5 + cls % 4) << (cls / 4 + 6);
+}
+
+// Chunks are counted as store when they're allocated, and a block's bytes move
+// to the tag using it while it's handed out, so the tags add up to the chunks.
+void storeCount(int tag, long long delta) {
+    memCount(tag, delta);
+    memShift(MEM_STORE, -delta);
+}
+
+void *storeAlloc(rowStore *st, int tag, size_t n, size_t *cap) {
+    if (n > STORE_MAX_BLOCK) {
+        void *p = memMalloc(tag, n);
+        if (p == NULL) die("malloc");
+        *cap = n;
+        st->live[tag] += n;
+        return p;
+    }
+
+    size_t block;
+    void *p = NULL;
+    if (st->exact) {
+        block = n < STORE_MIN_BLOCK ? STORE_MIN_BLOCK : (n + STORE_ALIGN - 1) & ~(size_t)(STORE_ALIGN - 1);
+    } else {
+        int cls = storeClass(n);
+        block = storeClassSize(cls);
+        p = st->freelist[cls];
+        if (p) {
+            st->freelist[cls] = *(void **)p;
+            st->freeBytes -= block;
+        }
+    }
+    *cap = block;
+    if (p) {
+        st->live[tag] += block;
+        storeCount(tag, block);
+        return p;
+    }
+
+    storeChunk *chunk = st->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < block) {
+        size_t size = st->nextChunkSize ? st->nextChunkSize : STORE_CHUNK_MIN;
+        if (size < STORE_CHUNK_MAX) st->nextChunkSize = size * 2;
+
+        chunk = memMalloc(MEM_STORE, sizeof(storeChunk) + size);
+        if (chunk == NULL) die("malloc");
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = st->chunks;
+        st->chunks = chunk;
+        st->chunkBytes += size;
+    }
+
+    p = &chunk->data[chunk->used];
+    chunk->used += block;
+    st->live[tag] += block;
+    storeCount(tag, block);
+
+    return p;
+}
+
+void storeFree(rowStore *st, int tag, void *p, size_t cap) {
+    if (p == NULL) return;
+    st->live[tag] -= cap;
+    if (cap > STORE_MAX_BLOCK) {
+        memFree(tag, p);
+        return;
+    }
+    storeCount(tag, -(long long)cap);
+
+    // an exact block goes on the largest class it can hold
+    int cls = storeClass(cap);
+    if (storeClassSize(cls) > cap) cls--;
+    *(void **)p = st->freelist[cls];
+    st->freelist[cls] = p;
+    st->freeBytes += storeClassSize(cls);
+}
+
+void *storeReserve(rowStore *st, int tag, void *p, size_t *cap, size_t used, size_t need) {
+    if (need <= *cap) return p;
+
+    size_t want = *cap * 2;
+    if (want < need) want = need;
+
+    size_t newcap;
+    void *new = storeAlloc(st, tag, want, &newcap);
+    if (p) memcpy(new, p, used);
+    storeFree(st, tag, p, *cap);
+    *cap = newcap;
+
+    return new;
+}
+
+// Render and cluster buffers are only needed by some rows, so rather than a
+// capacity field in every row they keep theirs in front of the block.
+void *storeAllocSized(rowStore *st, int tag, size_t n) {
+    size_t cap;
+    size_t *block = storeAlloc(st, tag, n + sizeof(size_t), &cap);
+    *block = cap;
+
+    return block + 1;
+}
+
+size_t storeSizedCap(void *p) {
+    return p ? ((size_t *)p)[-1] - sizeof(size_t) : 0;
+}
+
+void storeFreeSized(rowStore *st, int tag, void *p) {
+    if (p == NULL) return;
+    size_t *block = (size_t *)p - 1;
+    storeFree(st, tag, block, *block);
+}
+
+void storeReset(rowStore *st) {
+    // only chunk blocks are left, large ones were freed one by one
+    for (int i = 0; i < MEM_TAGS; i++) storeCount(i, -st->live[i]);
+    storeChunk *chunk = st->chunks;
+    while (chunk) {
+        storeChunk *next = chunk->next;
+        memFree(MEM_STORE, chunk);
+        chunk = next;
+    }
+    memset(st, 0, sizeof(*st));
+}
+
+/* PERFORMANCE */
+// Latencies go into log-linear histograms in the style of HdrHistogram: values
+// below 2^PERF_SUB_BITS ns are exact, above that each power of two is split
+// into 2^PERF_SUB_BITS buckets, so every recorded value is within ~6%.
+long long perfNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int perfBucket(long long ns) {
+    if (ns < 0) ns = 0;
+    if (ns < PERF_SUB_BUCKETS) return ns;
+
+    int msb = 0;
+    while ((ns >> msb) > 1) msb++;
+    int shift = msb - PERF_SUB_BITS;
+
+    return (shift + 1) * PERF_SUB_BUCKETS + (int)((ns >> shift) - PERF_SUB_BUCKETS);
+}
+
+long long perfBucketValue(int bucket) {
+    if (bucket < PERF_SUB_BUCKETS) return bucket;
+
+    int shift = bucket / PERF_SUB_BUCKETS - 1;
+
+    return (long long)(bucket % PERF_SUB_BUCKETS + PERF_SUB_BUCKETS) << shift;
+}
+
+void perfRecord(int stage, long long ns) {
+    perfHistogram *h = &E.perf.stages[stage];
+    h->counts[perfBucket(ns)]++;
+    h->total++;
+    if (ns > h->max) h->max = ns;
+}
+
+long long perfPercentile(int stage, double pct) {
+    perfHistogram *h = &E.perf.stages[stage];
+    if (h->total == 0) return 0;
+
+    unsigned long long want = (unsigned long long)(h->total * pct / 100.0);
+    if (want == 0) want = 1;
+
+    unsigned long long seen = 0;
+    for (int i = 0; i < PERF_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) return perfBucketValue(i);
+    }
+
+    return h->max;
+}
+
+void perfKeyStart(void) {
+    if (!E.perf.enabled) return;
+    E.perf.keyStart = perfNow();
+    E.perf.highlightNanos = 0;
+    E.perf.pending = 1;
+}
+
+void perfToggleOverlay(void) {
+    E.perf.overlay = !E.perf.overlay;
+}
+
+void perfDrawOverlay(appendBuffer *ab) {
+    static const char *names[PERF_STAGES] = { "proc", "hl", "frame", "write", "total" };
+    char line[256];
+    int len = snprintf(line, sizeof(line), "p50/p99 us:");
+
+    for (int i = 0; i < PERF_STAGES && len < (int)sizeof(line); i++)
+        len += snprintf(&line[len], sizeof(line) - len, " %s %lld/%lld", names[i],
+                        perfPercentile(i, 50) / 1000, perfPercentile(i, 99) / 1000);
+
+    if (len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+    if (len > E.screencols) len = E.screencols;
+    abAppend(ab, line, len);
+}
+
+void perfDump(void) {
+    static const char *names[PERF_STAGES] = { "process", "highlight", "frame", "write", "total" };
+    char *path = getenv("KILO_PERF_LOG");
+    if (path == NULL || !E.perf.enabled) return;
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return;
+
+    fprintf(fp, "%-10s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+    for (int i = 0; i < PERF_STAGES; i++) {
+        fprintf(fp, "%-10s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[i], E.perf.stages[i].total,
+                perfPercentile(i, 50) / 1000.0, perfPercentile(i, 90) / 1000.0,
+                perfPercentile(i, 99) / 1000.0, perfPercentile(i, 99.9) / 1000.0,
+                E.perf.stages[i].max / 1000.0);
+    }
+
+    fprintf(fp, "\n%-10s %14s %14s %14s\n", "memory", "live_bytes", "peak_bytes", "allocs");
+    for (int i = 0; i < MEM_TAGS; i++)
+        fprintf(fp, "%-10s %14lld %14lld %14llu\n", MEM_TAG_NAMES[i], E.mem[i].live, E.mem[i].peak, E.mem[i].allocs);
+    fclose(fp);
+}
+
+/* REPLAY */
+// Headless mode: keys come from a recorded file instead of the terminal and
+// frames are built as usual but counted instead of written, so a captured
+// session can be rerun as a benchmark.
+void replayStart(char *path, char *size) {
+    E.replay.fd = open(path, O_RDONLY);
+    if (E.replay.fd == -1) die("open");
+
+    E.screenrows = REPLAY_ROWS;
+    E.screencols = REPLAY_COLS;
+    if (size && (sscanf(size, "%dx%d", &E.screenrows, &E.screencols) != 2 ||
+                 E.screenrows < 3 || E.screencols < 1)) {
+        fprintf(stderr, "bad --size %s, expected ROWSxCOLS\n", size);
+        exit(1);
+    }
+
+    E.infd = E.replay.fd;
+    E.replay.active = 1;
+}
+
+void replayFinish(void) {
+    double secs = (perfNow() - E.replay.start) / 1e9;
+
+    printf("{\"replay\":\"done\",\"keys\":%llu,\"frames\":%llu,\"output_bytes\":%llu,\"seconds\":%.6f,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           E.replay.keys, E.replay.frames, E.replay.bytes, secs,
+           perfPercentile(PERF_TOTAL, 50) / 1000.0, perfPercentile(PERF_TOTAL, 90) / 1000.0,
+           perfPercentile(PERF_TOTAL, 99) / 1000.0, perfPercentile(PERF_TOTAL, 99.9) / 1000.0,
+           E.perf.stages[PERF_TOTAL].max / 1000.0);
+    exit(0);
 }
 
 /* TERMINAL */
@@ -222,18 +1194,23 @@ int editorReadKey(void) {
     int nread;
     char c;
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    while ((nread = read(E.infd, &c, 1)) != 1) {
         if (nread == 1 && errno != EAGAIN) die("read");
+        if (nread == 0 && E.replay.active) replayFinish();
+        backgroundWait();
+    }
+    perfKeyStart();
+    E.replay.keys++;
 
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (read(E.infd, &seq[0], 1) != 1) return '\x1b';
+        if (read(E.infd, &seq[1], 1) != 1) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (read(E.infd, &seq[2], 1) != 1) return '\x1b';
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME_KEY;
@@ -300,22 +1277,142 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/* UNICODE */
+// Codepoint ranges that do not take one terminal column: combining marks and
+// zero-width characters (0) and East Asian wide/fullwidth characters (2).
+static const unicodeWidthRange unicodeWidths[] = {
+    { 0x0300, 0x036F, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05BD, 0 },
+    { 0x0610, 0x061A, 0 }, { 0x064B, 0x065F, 0 }, { 0x0670, 0x0670, 0 },
+    { 0x06D6, 0x06DC, 0 }, { 0x06DF, 0x06E4, 0 }, { 0x0900, 0x0902, 0 },
+    { 0x093A, 0x093A, 0 }, { 0x093C, 0x093C, 0 }, { 0x0941, 0x0948, 0 },
+    { 0x094D, 0x094D, 0 }, { 0x0E31, 0x0E31, 0 }, { 0x0E34, 0x0E3A, 0 },
+    { 0x0E47, 0x0E4E, 0 }, { 0x1100, 0x115F, 2 }, { 0x1AB0, 0x1AFF, 0 },
+    { 0x1DC0, 0x1DFF, 0 }, { 0x200B, 0x200F, 0 }, { 0x202A, 0x202E, 0 },
+    { 0x2060, 0x2064, 0 }, { 0x20D0, 0x20FF, 0 }, { 0x231A, 0x231B, 2 },
+    { 0x2329, 0x232A, 2 }, { 0x23E9, 0x23EC, 2 }, { 0x25FD, 0x25FE, 2 },
+    { 0x2614, 0x2615, 2 }, { 0x2648, 0x2653, 2 }, { 0x26A1, 0x26A1, 2 },
+    { 0x26AA, 0x26AB, 2 }, { 0x26BD, 0x26BE, 2 }, { 0x26C4, 0x26C5, 2 },
+    { 0x26D4, 0x26D4, 2 }, { 0x26EA, 0x26EA, 2 }, { 0x26F2, 0x26F5, 2 },
+    { 0x26FA, 0x26FD, 2 }, { 0x2705, 0x2705, 2 }, { 0x270A, 0x270B, 2 },
+    { 0x2728, 0x2728, 2 }, { 0x274C, 0x274C, 2 }, { 0x2753, 0x2755, 2 },
+    { 0x2795, 0x2797, 2 }, { 0x2B1B, 0x2B1C, 2 }, { 0x2E80, 0x303E, 2 },
+    { 0x3041, 0x3098, 2 }, { 0x3099, 0x309A, 0 }, { 0x309B, 0x33FF, 2 },
+    { 0x3400, 0x4DBF, 2 }, { 0x4E00, 0x9FFF, 2 }, { 0xA000, 0xA4CF, 2 },
+    { 0xA960, 0xA97F, 2 }, { 0xAC00, 0xD7A3, 2 }, { 0xF900, 0xFAFF, 2 },
+    { 0xFE00, 0xFE0F, 0 }, { 0xFE10, 0xFE19, 2 }, { 0xFE20, 0xFE2F, 0 },
+    { 0xFE30, 0xFE6F, 2 }, { 0xFEFF, 0xFEFF, 0 }, { 0xFF00, 0xFF60, 2 },
+    { 0xFFE0, 0xFFE6, 2 }, { 0x16FE0, 0x16FE4, 2 }, { 0x17000, 0x18CFF, 2 },
+    { 0x1B000, 0x1B2FF, 2 }, { 0x1F004, 0x1F004, 2 }, { 0x1F0CF, 0x1F0CF, 2 },
+    { 0x1F18E, 0x1F18E, 2 }, { 0x1F191, 0x1F19A, 2 }, { 0x1F200, 0x1F251, 2 },
+    { 0x1F300, 0x1F64F, 2 }, { 0x1F680, 0x1F6FF, 2 }, { 0x1F7E0, 0x1F7EB, 2 },
+    { 0x1F90C, 0x1F9FF, 2 }, { 0x1FA70, 0x1FAFF, 2 }, { 0x20000, 0x2FFFD, 2 },
+    { 0x30000, 0x3FFFD, 2 }, { 0xE0001, 0xE007F, 0 }, { 0xE0100, 0xE01EF, 0 },
+};
+
+// Decodes one UTF-8 sequence. Malformed input decodes as a single byte with
+// UNICODE_INVALID so it can be shown as a placeholder and stepped over.
+int unicodeDecode(const char *s, ssize_t len, unsigned int *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    int n;
+    unsigned int min;
+
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if ((u[0] & 0xE0) == 0xC0) {
+        n = 2;
+        min = 0x80;
+        *cp = u[0] & 0x1F;
+    } else if ((u[0] & 0xF0) == 0xE0) {
+        n = 3;
+        min = 0x800;
+        *cp = u[0] & 0x0F;
+    } else if ((u[0] & 0xF8) == 0xF0) {
+        n = 4;
+        min = 0x10000;
+        *cp = u[0] & 0x07;
+    } else {
+        *cp = UNICODE_INVALID;
+        return 1;
+    }
+
+    if (n > len) {
+        *cp = UNICODE_INVALID;
+        return 1;
+    }
+    for (int i = 1; i < n; i++) {
+        if ((u[i] & 0xC0) != 0x80) {
+            *cp = UNICODE_INVALID;
+            return 1;
+        }
+        *cp = (*cp << 6) | (u[i] & 0x3F);
+    }
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+        *cp = UNICODE_INVALID;
+        return 1;
+    }
+
+    return n;
+}
+
+int unicodeWidth(unsigned int cp) {
+    if (cp < 0x300) return 1;
+
+    int lo = 0;
+    int hi = sizeof(unicodeWidths) / sizeof(unicodeWidths[0]) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < unicodeWidths[mid].first) hi = mid - 1;
+        else if (cp > unicodeWidths[mid].last) lo = mid + 1;
+        else return unicodeWidths[mid].width;
+    }
+
+    return 1;
+}
+
+// One pass over a row that counts tabs and reports whether any byte is
+// non-ASCII. Pure ASCII rows then skip decoding everywhere else.
+int unicodeScan(const char *s, ssize_t len, ssize_t *tabs) {
+    ssize_t i = 0;
+    ssize_t count = 0;
+    int high = 0;
+
+#ifdef __SSE2__
+    __m128i tab = _mm_set1_epi8('\t');
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)&s[i]);
+        acc = _mm_or_si128(acc, chunk);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, tab)));
+    }
+    high = _mm_movemask_epi8(acc) != 0;
+#endif
+
+    for (; i < len; i++) {
+        if (s[i] == '\t') count++;
+        high |= (unsigned char)s[i] >> 7;
+    }
+
+    *tabs = count;
+    return high;
+}
+
 /* SYNTAX HIGHLIGHTING */
 int isSeparator(int c) {
+    c = (unsigned char)c;
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(editorRow *row) {
-    row->hl = realloc(row->hl, row->rsize);
+void editorUpdateSyntax(editorBuffer *buf, editorRow *row) {
     memset(row->hl, HL_NORMAL, row->rsize);
 
-    if (E.syntax == NULL) return;
+    if (buf->syntax == NULL) return;
 
-    char **keywords = E.syntax->keywords;
+    char **keywords = buf->syntax->keywords;
 
-    char *scs = E.syntax->singleLineCommentStart;
-    char *mcs = E.syntax->multiLineCommentStart;
-    char *mce = E.syntax->multiLineCommentEnd;
+    char *scs = buf->syntax->singleLineCommentStart;
+    char *mcs = buf->syntax->multiLineCommentStart;
+    char *mce = buf->syntax->multiLineCommentEnd;
 
     int scsLen = scs ? strlen(scs) : 0;
     int mcsLen = mcs ? strlen(mcs) : 0;
@@ -323,9 +1420,9 @@ void editorUpdateSyntax(editorRow *row) {
 
     int prevSep = 1;
     int inString = 0;
-    int inComment = (row->idx > 0 && E.row[row->idx - 1].hlOpenComment);
+    int inComment = (row->idx > 0 && buf->row[row->idx - 1].hlOpenComment);
 
-    int i = 0;
+    ssize_t i = 0;
     while(i < row->rsize) {
         char c = row->render[i];
         unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
@@ -358,7 +1455,7 @@ void editorUpdateSyntax(editorRow *row) {
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        if (buf->syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (inString) {
                 row->hl[i] = HL_STRING;
                 if (c == '\\' && i + 1 < row->rsize) {
@@ -380,8 +1477,8 @@ void editorUpdateSyntax(editorRow *row) {
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prevSep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
+        if (buf->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit((unsigned char)c) && (prevSep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
                 row->hl[i] = HL_NUMBER;
                 i++;
                 prevSep = 0;
@@ -414,7 +1511,26 @@ void editorUpdateSyntax(editorRow *row) {
 
     int changed = (row->hlOpenComment != inComment);
     row->hlOpenComment = inComment;
-    if (changed && row->idx + 1 < E.numrows) editorUpdateSyntax(&E.row[row->idx + 1]);
+    if (changed && row->idx + 1 < buf->numrows) editorHighlightRow(buf, &buf->row[row->idx + 1]);
+}
+
+void editorHighlightRow(editorBuffer *buf, editorRow *row) {
+    if ((size_t)row->rsize + 1 > row->hlcapacity) {
+        storeFree(&buf->store, MEM_HIGHLIGHT, row->hl, row->hlcapacity);
+        row->hl = storeAlloc(&buf->store, MEM_HIGHLIGHT, row->rsize + 1, &row->hlcapacity);
+    }
+    row->hlStale = 0;
+    editorUpdateSyntax(buf, row);
+}
+
+// After a bulk change: highlights the rows in order, so a comment opened in
+// one carries into the next without rehighlighting any row twice.
+void editorHighlightRows(editorBuffer *buf, ssize_t start, ssize_t n) {
+    if (buf->syntax == NULL) return;
+
+    for (ssize_t i = start; i < start + n; i++) buf->row[i].hlStale = 1;
+    for (ssize_t i = start; i < start + n; i++)
+        if (buf->row[i].hlStale) editorHighlightRow(buf, &buf->row[i]);
 }
 
 int editorSyntaxToColour(int hl) {
@@ -430,11 +1546,11 @@ int editorSyntaxToColour(int hl) {
     }
 }
 
-void editorSelectSyntaxHighlight(void) {
-    E.syntax = NULL;
-    if (E.filename == NULL) return;
+void editorSelectSyntaxHighlight(editorBuffer *buf) {
+    buf->syntax = NULL;
+    if (buf->filename == NULL) return;
 
-    char *ext = strrchr(E.filename, '.');
+    char *ext = strrchr(buf->filename, '.');
 
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
         struct editorSyntax *s = &HLDB[j];
@@ -442,12 +1558,12 @@ void editorSelectSyntaxHighlight(void) {
         while (s->filematch[i]) {
             int isExt = (s->filematch[i][0] == '.');
             if ((isExt && ext && !strcmp(ext, s->filematch[i])) ||
-                (!isExt && strstr(E.filename, s->filematch[i]))) {
-                    E.syntax = s;
+                (!isExt && strstr(buf->filename, s->filematch[i]))) {
+                    buf->syntax = s;
 
-                    int filerow;
-                    for (filerow = 0; filerow < E.numrows; filerow++)
-                        editorUpdateSyntax(&E.row[filerow]);
+                    ssize_t filerow;
+                    for (filerow = 0; filerow < buf->numrows; filerow++)
+                        editorHighlightRow(buf, &buf->row[filerow]);
 
                     return;
             }
@@ -457,240 +1573,2525 @@ void editorSelectSyntaxHighlight(void) {
 }
 
 /* ROW OPERATIONS */
-int editorRowCxToRx(editorRow *row, int cx) {
-    int rx = 0;
-    for (int i = 0; i < cx; i++) {
-        if (row->chars[i] == '\t') rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        rx++;
+ssize_t editorRowCxToRx(editorRow *row, ssize_t cx) {
+    if (row->ascii && !row->ownrender) return cx;
+    if (row->layout && cx >= row->size) return row->layout->width;
+
+    ssize_t rx = 0;
+    ssize_t i = 0;
+    rowMark *m = editorRowMark(row, cx, row->layout ? row->layout->width : 0);
+    if (m) {
+        i = m->cx;
+        rx = m->rx;
+    }
+    while (i < cx) {
+        if (row->chars[i] == '\t') {
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+            rx++;
+            i++;
+        } else if (row->ascii) {
+            rx++;
+            i++;
+        } else {
+            unsigned int cp;
+            i += unicodeDecode(&row->chars[i], row->size - i, &cp);
+            rx += cp == UNICODE_INVALID ? 1 : unicodeWidth(cp);
+        }
     }
 
     return rx;
 }
 
-int editorRowRxToCx(editorRow *row, int rx) {
-    int cur_rx = 0;
-    int cx = 0;
-    for (int cx = 0; cx < row->size; cx++) {
+ssize_t editorRowRxToCx(editorRow *row, ssize_t rx) {
+    if (row->ascii && !row->ownrender) return rx < row->size ? rx : row->size;
+
+    ssize_t cur_rx = 0;
+    ssize_t cx = 0;
+    rowMark *m = editorRowMark(row, row->size, rx);
+    if (m) {
+        cx = m->cx;
+        cur_rx = m->rx;
+    }
+    while (cx < row->size) {
+        int n = 1;
         if (row->chars[cx] == '\t')
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        cur_rx++;
+            cur_rx += KILO_TAB_STOP - (cur_rx % KILO_TAB_STOP);
+        else if (row->ascii)
+            cur_rx++;
+        else {
+            unsigned int cp;
+            n = unicodeDecode(&row->chars[cx], row->size - cx, &cp);
+            cur_rx += cp == UNICODE_INVALID ? 1 : unicodeWidth(cp);
+        }
 
         if (cur_rx > rx) return cx;
+        cx += n;
     }
 
     return cx;
 }
 
-void editorUpdateRow(editorRow *row) {
-    int tabs = 0;
-    for (int i = 0; i < row->size; i++)
-        if (row->chars[i] == '\t') tabs++;
-    
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+ssize_t editorRowRenderToRx(editorRow *row, ssize_t roff) {
+    if (row->ascii) return roff;
+
+    ssize_t rx = 0;
+    for (ssize_t i = 0; i < roff;) {
+        unsigned int cp;
+        i += unicodeDecode(&row->render[i], row->rsize - i, &cp);
+        rx += cp == UNICODE_INVALID ? 1 : unicodeWidth(cp);
+    }
+
+    return rx;
+}
+
+// The last mark at or before both cx and rx, NULL if there is none.
+rowMark *editorRowMark(editorRow *row, ssize_t cx, ssize_t rx) {
+    if (row->layout == NULL) return NULL;
+
+    rowMark *marks = row->layout->marks;
+    ssize_t lo = 0;
+    ssize_t hi = row->size / ROW_MARK_STEP;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (marks[mid].cx <= cx && marks[mid].rx <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo > 0 ? &marks[lo - 1] : NULL;
+}
+
+unsigned char *editorRowClusters(editorRow *row) {
+    if (row->layout == NULL || row->ascii) return NULL;
+
+    return (unsigned char *)&row->layout->marks[row->size / ROW_MARK_STEP];
+}
 
-    int idx = 0;
-    for (int i = 0; i < row->size; i++) {
+int editorRowIsClusterStart(editorRow *row, ssize_t cx) {
+    unsigned char *clusters = editorRowClusters(row);
+    if (clusters == NULL || cx <= 0 || cx >= row->size) return 1;
+
+    return clusters[cx >> 3] & (1 << (cx & 7));
+}
+
+ssize_t editorRowPrevCluster(editorRow *row, ssize_t cx) {
+    do cx--; while (cx > 0 && !editorRowIsClusterStart(row, cx));
+
+    return cx;
+}
+
+ssize_t editorRowNextCluster(editorRow *row, ssize_t cx) {
+    do cx++; while (cx < row->size && !editorRowIsClusterStart(row, cx));
+
+    return cx;
+}
+
+// One pass over the row finds its width, a mark at the first character from
+// every ROW_MARK_STEP bytes, and for non-ASCII rows the bytes the cursor may
+// stop on: the first byte of every codepoint that is not a zero-width mark
+// attached to the character before it.
+void editorUpdateLayout(editorBuffer *buf, editorRow *row) {
+    ssize_t nmarks = row->size / ROW_MARK_STEP;
+    size_t bitmap = row->ascii ? 0 : row->size / 8 + 1;
+    size_t need = sizeof(rowLayout) + sizeof(rowMark) * nmarks + bitmap;
+    if (need > storeSizedCap(row->layout)) {
+        storeFreeSized(&buf->store, MEM_RENDER, row->layout);
+        row->layout = storeAllocSized(&buf->store, MEM_RENDER, need);
+    }
+    rowMark *marks = row->layout->marks;
+    unsigned char *clusters = editorRowClusters(row);
+    if (clusters) memset(clusters, 0, bitmap);
+
+    ssize_t k = 0;
+    ssize_t roff = 0;
+    ssize_t rx = 0;
+    for (ssize_t i = 0; i < row->size;) {
+        for (; k < nmarks && i >= (k + 1) * ROW_MARK_STEP; k++) {
+            marks[k].cx = i;
+            marks[k].roff = roff;
+            marks[k].rx = rx;
+        }
+
+        int n = 1;
+        int w = 1;
         if (row->chars[i] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % 8 != 0) row->render[idx++] = ' ';
-        } else row->render[idx++] = row->chars[i];
+            w = KILO_TAB_STOP - rx % KILO_TAB_STOP;
+            roff += w;
+        } else {
+            if (!row->ascii) {
+                unsigned int cp;
+                n = unicodeDecode(&row->chars[i], row->size - i, &cp);
+                w = cp == UNICODE_INVALID ? 1 : unicodeWidth(cp);
+            }
+            roff += n;
+        }
+        if (clusters && (i == 0 || w != 0)) clusters[i >> 3] |= 1 << (i & 7);
+        rx += w;
+        i += n;
+    }
+    // a character running over the last step boundary leaves marks at the end
+    for (; k < nmarks; k++) {
+        marks[k].cx = row->size;
+        marks[k].roff = roff;
+        marks[k].rx = rx;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    row->layout->width = rx;
+}
 
-    editorUpdateSyntax(row);
+void editorFreeRender(editorBuffer *buf, editorRow *row) {
+    if (row->ownrender) storeFreeSized(&buf->store, MEM_RENDER, row->render);
+    row->render = NULL;
+    row->ownrender = 0;
 }
 
-void editorInsertRow(int pos, char *s, size_t len) {
-    if (pos < 0 || pos > E.numrows) return;
+// Rows without tabs render byte-for-byte, so render points straight at chars
+// and only rows that need tab expansion own a separate render buffer.
+void editorUpdateRow(editorBuffer *buf, editorRow *row) {
+    ssize_t tabs;
+    row->ascii = !unicodeScan(row->chars, row->size, &tabs);
 
-    E.row = realloc(E.row, sizeof(editorRow) * (E.numrows + 1));
-    memmove(&E.row[pos + 1], &E.row[pos], sizeof(editorRow) * (E.numrows - pos));
-    for (int j = pos + 1; j <= E.numrows; j++)
-        E.row[j].idx++;
+    if (row->ascii && (tabs == 0 || row->size < ROW_MARK_STEP)) {
+        storeFreeSized(&buf->store, MEM_RENDER, row->layout);
+        row->layout = NULL;
+    } else editorUpdateLayout(buf, row);
 
-    E.row[pos].idx = pos;
-    
-    E.row[pos].size = len;
-    E.row[pos].chars = malloc(len + 1);
-    memcpy(E.row[pos].chars, s, len);
-    E.row[pos].chars[len] = '\0';
+    size_t need = row->size + tabs*(KILO_TAB_STOP - 1) + 1;
+
+    if (tabs == 0) {
+        editorFreeRender(buf, row);
+        row->render = row->chars;
+        row->rsize = row->size;
+    } else {
+        if (!row->ownrender || need > storeSizedCap(row->render)) {
+            editorFreeRender(buf, row);
+            row->render = storeAllocSized(&buf->store, MEM_RENDER, need);
+            row->ownrender = 1;
+        }
+
+        // tab stops are display columns, which differ from bytes for UTF-8
+        ssize_t idx = 0;
+        ssize_t col = 0;
+        for (ssize_t i = 0; i < row->size;) {
+            if (row->chars[i] == '\t') {
+                row->render[idx++] = ' ';
+                col++;
+                while (col % KILO_TAB_STOP != 0) {
+                    row->render[idx++] = ' ';
+                    col++;
+                }
+                i++;
+            } else if (row->ascii) {
+                row->render[idx++] = row->chars[i++];
+                col++;
+            } else {
+                unsigned int cp;
+                int n = unicodeDecode(&row->chars[i], row->size - i, &cp);
+                memcpy(&row->render[idx], &row->chars[i], n);
+                idx += n;
+                i += n;
+                col += cp == UNICODE_INVALID ? 1 : unicodeWidth(cp);
+            }
+        }
+        row->render[idx] = '\0';
+        row->rsize = idx;
+    }
+
+    filterRowUpdated(buf, row);
+    diffRowUpdated(buf, row);
+    buf->version++;
+
+    if (buf->deferHighlight) {
+        row->hlStale = 1;
+        return;
+    }
+
+    long long start = E.perf.pending ? perfNow() : 0;
+    editorHighlightRow(buf, row);
+    if (E.perf.pending) E.perf.highlightNanos += perfNow() - start;
+}
+
+// Makes room for n rows at pos, which the caller fills in with editorSetRow.
+void editorOpenRows(editorBuffer *buf, ssize_t pos, ssize_t n) {
+    if (buf->numrows + n > buf->rowcap) {
+        buf->rowcap = buf->rowcap ? buf->rowcap * 2 : 64;
+        if (buf->rowcap < buf->numrows + n) buf->rowcap = buf->numrows + n;
+        buf->row = memRealloc(MEM_TEXT, buf->row, sizeof(editorRow) * buf->rowcap);
+        if (buf->row == NULL) die("realloc");
+    }
+    memmove(&buf->row[pos + n], &buf->row[pos], sizeof(editorRow) * (buf->numrows - pos));
+    for (ssize_t j = pos + n; j < buf->numrows + n; j++)
+        buf->row[j].idx += n;
+    filterRowsInserted(buf, pos, n);
+    diffRowsInserted(buf, pos, n);
+
+    buf->numrows += n;
+    buf->dirty++;
+}
+
+void editorSetRow(editorBuffer *buf, ssize_t pos, char *s, size_t len) {
+    editorRow *row = &buf->row[pos];
+    row->idx = pos;
+
+    row->size = len;
+    row->chars = storeAlloc(&buf->store, MEM_TEXT, len + 1, &row->capacity);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->rsize = 0;
+    row->hlcapacity = 0;
+    row->render = NULL;
+    row->ownrender = 0;
+    row->hl = NULL;
+    row->layout = NULL;
+    row->hlOpenComment = 0;
+    row->hlStale = 0;
+    row->shared = 0;
+    editorUpdateRow(buf, row);
+}
+
+void editorInsertRow(editorBuffer *buf, ssize_t pos, char *s, size_t len) {
+    if (pos < 0 || pos > buf->numrows) return;
+
+    editorOpenRows(buf, pos, 1);
+    editorSetRow(buf, pos, s, len);
+}
 
-    E.row[pos].rsize = 0;
-    E.row[pos].render = NULL;
-    E.row[pos].hl = NULL;
-    E.row[pos].hlOpenComment = 0;
-    editorUpdateRow(&E.row[pos]);
+void editorFreeRow(editorBuffer *buf, editorRow *row) {
+    if (row->shared) clipRelease(buf, row);
+    editorFreeRender(buf, row);
+    storeFree(&buf->store, MEM_TEXT, row->chars, row->capacity);
+    storeFree(&buf->store, MEM_HIGHLIGHT, row->hl, row->hlcapacity);
+    storeFreeSized(&buf->store, MEM_RENDER, row->layout);
+}
 
-    E.numrows++;
-    E.dirty++;
+void editorFreeRows(editorBuffer *buf) {
+    clipRelease(buf, NULL);
+    undoClear(buf);
+    for (ssize_t i = 0; i < buf->numrows; i++) {
+        editorRow *row = &buf->row[i];
+        if (row->capacity > STORE_MAX_BLOCK) storeFree(&buf->store, MEM_TEXT, row->chars, row->capacity);
+        if (row->hlcapacity > STORE_MAX_BLOCK) storeFree(&buf->store, MEM_HIGHLIGHT, row->hl, row->hlcapacity);
+        // rare enough to free one by one, which also catches the large ones
+        editorFreeRender(buf, row);
+        storeFreeSized(&buf->store, MEM_RENDER, row->layout);
+    }
+    storeReset(&buf->store);
+    buf->numrows = 0;
+    filterRowsFreed(buf);
 }
 
-void editorFreeRow(editorRow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+void editorDeleteRows(editorBuffer *buf, ssize_t pos, ssize_t n) {
+    if (pos < 0 || n <= 0 || pos + n > buf->numrows) return;
+    for (ssize_t j = pos; j < pos + n; j++) editorFreeRow(buf, &buf->row[j]);
+    memmove(&buf->row[pos], &buf->row[pos + n], sizeof(editorRow) * (buf->numrows - pos - n));
+    for (ssize_t j = pos; j < buf->numrows - n; j++) buf->row[j].idx -= n;
+    filterRowsDeleted(buf, pos, n);
+    diffRowsDeleted(buf, pos, n);
+    buf->version++;
+    buf->numrows -= n;
+    buf->dirty++;
 }
 
-void editorDeleteRow(int pos) {
-    if (pos < 0 || pos >= E.numrows) return;
-    editorFreeRow(&E.row[pos]);
-    memmove(&E.row[pos], &E.row[pos + 1], sizeof(editorRow) * (E.numrows - pos - 1));
-    for (int j = pos; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+void editorDeleteRow(editorBuffer *buf, ssize_t pos) {
+    editorDeleteRows(buf, pos, 1);
 }
 
-void editorRowInsertChar(editorRow *row, int pos, int c) {
+void editorRowInsertChar(editorBuffer *buf, editorRow *row, ssize_t pos, int c) {
     if (pos < 0 || pos > row->size) pos = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
+    if (row->shared) clipRelease(buf, row);
+    row->chars = storeReserve(&buf->store, MEM_TEXT, row->chars, &row->capacity, row->size + 1, row->size + 2);
     memmove(&row->chars[pos + 1], &row->chars[pos], row->size - pos + 1);
     row->size++;
     row->chars[pos] = c;
-    editorUpdateRow(row);
+    editorUpdateRow(buf, row);
 }
 
-void editorRowAppendString(editorRow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
+void editorRowAppendString(editorBuffer *buf, editorRow *row, char *s, size_t len) {
+    if (row->shared) clipRelease(buf, row);
+    row->chars = storeReserve(&buf->store, MEM_TEXT, row->chars, &row->capacity, row->size + 1, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    editorUpdateRow(buf, row);
+    buf->dirty++;
 }
 
-void editorRowDeleteChar(editorRow *row, int pos) {
+void editorRowDeleteChar(editorBuffer *buf, editorRow *row, ssize_t pos) {
     if (pos < 0 || pos >= row->size) return;
+    if (row->shared) clipRelease(buf, row);
     memmove(&row->chars[pos], &row->chars[pos + 1], row->size - pos);
     row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    editorUpdateRow(buf, row);
+    buf->dirty++;
 }
 
 /* EDITOR OPERATIONS */
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+void editorInsertChar(editorView *v, int c) {
+    editorBuffer *buf = v->buf;
+    if (v->cy == buf->numrows) editorInsertRow(buf, buf->numrows, "", 0);
+    editorRowInsertChar(buf, &buf->row[v->cy], v->cx, c);
+    v->cx++;
 }
 
-void editorInsertNewLine(void) {
-    if (E.cx == 0) editorInsertRow(E.cy, "", 0);
+void editorInsertNewLine(editorView *v) {
+    editorBuffer *buf = v->buf;
+    if (v->cx == 0) editorInsertRow(buf, v->cy, "", 0);
     else {
-        editorRow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
+        editorRow *row = &buf->row[v->cy];
+        editorInsertRow(buf, v->cy + 1, &row->chars[v->cx], row->size - v->cx);
+        row = &buf->row[v->cy];
+        if (row->shared) clipRelease(buf, row);
+        row->size = v->cx;
         row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        editorUpdateRow(buf, row);
     }
-    E.cy++;
-    E.cx = 0;
+    v->cy++;
+    v->cx = 0;
 }
 
-void editorDeleteChar(void) {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+void editorDeleteChar(editorView *v) {
+    editorBuffer *buf = v->buf;
+    if (v->cy == buf->numrows) return;
+    if (v->cx == 0 && v->cy == 0) return;
 
-    editorRow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDeleteChar(row, E.cx - 1);
-        E.cx--;
+    editorRow *row = &buf->row[v->cy];
+    if (v->cx > 0) {
+        ssize_t prev = editorRowPrevCluster(row, v->cx);
+        while (v->cx > prev) editorRowDeleteChar(buf, row, --v->cx);
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDeleteRow(E.cy);
-        E.cy--;
+        v->cx = buf->row[v->cy - 1].size;
+        editorRowAppendString(buf, &buf->row[v->cy - 1], row->chars, row->size);
+        editorDeleteRow(buf, v->cy);
+        v->cy--;
     }
 }
 
-/* FILE I/O */
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    for (int i = 0; i < E.numrows; i++)
-        totlen += E.row[i].size + 1;
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (int i = 0; i < E.numrows; i++) {
-        memcpy(p, E.row[i].chars, E.row[i].size);
-        p += E.row[i].size;
-        *p = '\n';
-        p++;
-    }
-
-    return buf;
+/* LINE OPERATIONS */
+// Sort, unique and reverse work on the marked rows, or the whole buffer, by
+// permuting editorRow records: the text never moves. Each operation keeps the
+// permutation as one undo step, valid until the next row change.
+void editorMarkedRows(editorView *v, ssize_t *start, ssize_t *end) {
+    editorBuffer *buf = v->buf;
+    *start = 0;
+    *end = buf->numrows;
+    if (!v->marked || buf->numrows == 0) return;
+
+    ssize_t a = v->marky < v->cy ? v->marky : v->cy;
+    ssize_t b = v->marky < v->cy ? v->cy : v->marky;
+    if (b >= buf->numrows) b = buf->numrows - 1;
+    if (a > b) a = b;
+    *start = a;
+    *end = b + 1;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+void lineSortFieldFor(lineSortOptions *opt, ssize_t pos) {
+    const char *s = opt->rows[pos].chars;
+    const char *end = s + opt->rows[pos].size;
 
-    editorSelectSyntaxHighlight();
+    for (int field = 1; field < opt->column && s < end; field++) {
+        if (opt->delim) {
+            while (s < end && *s != opt->delim) s++;
+            if (s < end) s++;
+        } else {
+            while (s < end && isspace((unsigned char)*s)) s++;
+            while (s < end && !isspace((unsigned char)*s)) s++;
+        }
+    }
+    if (opt->column && !opt->delim)
+        while (s < end && isspace((unsigned char)*s)) s++;
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+    const char *e = s;
+    if (opt->column) {
+        if (opt->delim) while (e < end && *e != opt->delim) e++;
+        else while (e < end && !isspace((unsigned char)*e)) e++;
+    } else e = end;
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    opt->fields[pos].key = s;
+    opt->fields[pos].keylen = e - s;
 }
 
-void editorSave(void) {
-    if (E.filename == NULL){
-        char *filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+ssize_t lineCommonPrefix(lineSortField *a, lineSortField *b) {
+    ssize_t n = a->keylen < b->keylen ? a->keylen : b->keylen;
+    ssize_t i = 0;
+    while (i < n && a->key[i] == b->key[i]) i++;
+
+    return i;
+}
+
+void lineSortKeyFor(lineSortKey *k, ssize_t pos, lineSortOptions *opt) {
+    lineSortField *f = &opt->fields[pos];
+    k->pos = pos;
+    k->prefix[0] = 0;
+    k->prefix[1] = 0;
+
+    if (opt->numeric) {
+        // chars is NUL-terminated, strtod stops at the field separator
+        double num = strtod(f->key, NULL);
+        if (num == 0) num = 0; // -0 sorts with 0
+        uint64_t bits;
+        memcpy(&bits, &num, sizeof(bits));
+        k->prefix[0] = bits >> 63 ? ~bits : bits | (1ULL << 63);
+    } else {
+        for (ssize_t i = 0; i < 16; i++) {
+            ssize_t at = opt->skip + i;
+            uint64_t byte = at < f->keylen ? (unsigned char)f->key[at] : 0;
+            k->prefix[i / 8] = k->prefix[i / 8] << 8 | byte;
+        }
+    }
+}
+
+int lineCompare(lineSortKey *a, lineSortKey *b, lineSortOptions *opt) {
+    int c = (a->prefix[0] > b->prefix[0]) - (a->prefix[0] < b->prefix[0]);
+    if (c == 0) c = (a->prefix[1] > b->prefix[1]) - (a->prefix[1] < b->prefix[1]);
+    if (c == 0 && !opt->numeric) {
+        lineSortField *fa = &opt->fields[a->pos];
+        lineSortField *fb = &opt->fields[b->pos];
+        ssize_t n = fa->keylen < fb->keylen ? fa->keylen : fb->keylen;
+        c = memcmp(fa->key + opt->skip, fb->key + opt->skip, n - opt->skip);
+        if (c == 0) c = (fa->keylen > fb->keylen) - (fa->keylen < fb->keylen);
+    }
+
+    return opt->reverse ? -c : c;
+}
+
+// Stable top-down merge sort, equal keys keep their order.
+void lineSortRange(lineSortKey *keys, lineSortKey *tmp, ssize_t n, lineSortOptions *opt) {
+    if (n < 16) {
+        for (ssize_t i = 1; i < n; i++) {
+            lineSortKey k = keys[i];
+            ssize_t j = i;
+            while (j > 0 && lineCompare(&keys[j - 1], &k, opt) > 0) {
+                keys[j] = keys[j - 1];
+                j--;
+            }
+            keys[j] = k;
+        }
+        return;
+    }
+
+    ssize_t mid = n / 2;
+    lineSortRange(keys, tmp, mid, opt);
+    lineSortRange(keys + mid, tmp + mid, n - mid, opt);
+    lineMerge(keys, tmp, 0, mid, n, opt);
+}
+
+void lineMerge(lineSortKey *keys, lineSortKey *tmp, ssize_t lo, ssize_t mid, ssize_t hi, lineSortOptions *opt) {
+    if (mid == lo || mid == hi || lineCompare(&keys[mid - 1], &keys[mid], opt) <= 0) return;
+
+    ssize_t i = lo;
+    ssize_t j = mid;
+    ssize_t k = lo;
+    while (i < mid && j < hi)
+        tmp[k++] = lineCompare(&keys[j], &keys[i], opt) < 0 ? keys[j++] : keys[i++];
+    while (i < mid) tmp[k++] = keys[i++];
+    while (j < hi) tmp[k++] = keys[j++];
+    memcpy(&keys[lo], &tmp[lo], sizeof(lineSortKey) * (hi - lo));
+}
+
+void *lineSortWorker(void *arg) {
+    lineSortJob *job = arg;
+    lineSortOptions *opt = job->opt;
+
+    switch (job->phase) {
+        case SORT_FIELDS:
+            job->common = -1;
+            for (ssize_t i = job->lo; i < job->hi; i++) {
+                lineSortFieldFor(opt, i);
+                ssize_t common = lineCommonPrefix(&opt->fields[job->lo], &opt->fields[i]);
+                if (job->common == -1 || common < job->common) job->common = common;
+            }
+            break;
+        case SORT_SLICE:
+            for (ssize_t i = job->lo; i < job->hi; i++) lineSortKeyFor(&job->keys[i], i, opt);
+            lineSortRange(job->keys + job->lo, job->tmp + job->lo, job->hi - job->lo, opt);
+            break;
+        case SORT_MERGE:
+            lineMerge(job->keys, job->tmp, job->lo, job->mid, job->hi, opt);
+            break;
+    }
+
+    return NULL;
+}
+
+void lineSortRun(lineSortJob *jobs, int njobs) {
+    if (njobs == 1) {
+        lineSortWorker(&jobs[0]);
+        return;
+    }
+
+    pthread_t tids[SORT_MAX_THREADS];
+    for (int i = 0; i < njobs; i++)
+        if (pthread_create(&tids[i], NULL, lineSortWorker, &jobs[i]) != 0) die("pthread_create");
+    for (int i = 0; i < njobs; i++) pthread_join(tids[i], NULL);
+}
+
+// Each thread finds the keys of one slice, then sorts it, then pairs of slices
+// are merged in rounds with half as many threads each time. Keys that all start
+// the same way, like log timestamps, are compared after their common prefix.
+void lineSortParallel(lineSortKey *keys, ssize_t n, lineSortOptions *opt) {
+    lineSortKey *tmp = memMalloc(MEM_TEXT, sizeof(lineSortKey) * (n ? n : 1));
+    if (tmp == NULL) die("malloc");
+
+    int threads = 1;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    while (n >= SORT_PARALLEL_MIN && threads * 2 <= cores && threads * 2 <= SORT_MAX_THREADS) threads *= 2;
+
+    lineSortJob jobs[SORT_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        jobs[i].keys = keys;
+        jobs[i].tmp = tmp;
+        jobs[i].lo = n * i / threads;
+        jobs[i].mid = 0;
+        jobs[i].hi = n * (i + 1) / threads;
+        jobs[i].opt = opt;
+        jobs[i].phase = SORT_FIELDS;
+    }
+    lineSortRun(jobs, threads);
+
+    opt->skip = 0;
+    if (n > 0 && !opt->numeric) {
+        opt->skip = jobs[0].common;
+        for (int i = 1; i < threads; i++) {
+            if (jobs[i].lo == jobs[i].hi) continue;
+            ssize_t common = lineCommonPrefix(&opt->fields[0], &opt->fields[jobs[i].lo]);
+            if (jobs[i].common < common) common = jobs[i].common;
+            if (common < opt->skip) opt->skip = common;
+        }
+    }
+
+    for (int i = 0; i < threads; i++) jobs[i].phase = SORT_SLICE;
+    lineSortRun(jobs, threads);
+
+    for (int width = 2; width <= threads; width *= 2) {
+        int njobs = threads / width;
+        for (int i = 0; i < njobs; i++) {
+            jobs[i].lo = n * (i * width) / threads;
+            jobs[i].mid = n * (i * width + width / 2) / threads;
+            jobs[i].hi = n * ((i + 1) * width) / threads;
+            jobs[i].phase = SORT_MERGE;
+        }
+        lineSortRun(jobs, njobs);
+    }
+
+    memFree(MEM_TEXT, tmp);
+}
+
+undoStep *undoPush(editorBuffer *buf, ssize_t start, ssize_t numrows) {
+    if (buf->numundo == KILO_UNDO_STEPS) {
+        undoDiscard(buf, &buf->undo[0]);
+        memmove(&buf->undo[0], &buf->undo[1], sizeof(undoStep) * (KILO_UNDO_STEPS - 1));
+        buf->numundo--;
+    }
+
+    undoStep *step = &buf->undo[buf->numundo++];
+    memset(step, 0, sizeof(undoStep));
+    step->start = start;
+    step->numrows = numrows;
+    step->order = memMalloc(MEM_UNDO, sizeof(ssize_t) * (numrows ? numrows : 1));
+    if (step->order == NULL) die("malloc");
+    step->before = buf->version;
+
+    return step;
+}
+
+void undoDiscard(editorBuffer *buf, undoStep *step) {
+    for (ssize_t i = 0; i < step->numdropped; i++) editorFreeRow(buf, &step->dropped[i]);
+    memFree(MEM_UNDO, step->order);
+    memFree(MEM_UNDO, step->dropped);
+    memFree(MEM_UNDO, step->droppedAt);
+}
+
+void undoClear(editorBuffer *buf) {
+    for (int i = 0; i < buf->numundo; i++) undoDiscard(buf, &buf->undo[i]);
+    buf->numundo = 0;
+}
+
+// Fixes up everything that depends on row positions after rows start..start+n
+// were rearranged, and re-highlights them in order so multi-line comments
+// follow the new order.
+void editorRowsMoved(editorBuffer *buf, ssize_t start, ssize_t n) {
+    for (ssize_t i = start; i < buf->numrows; i++) buf->row[i].idx = i;
+    for (ssize_t i = start; i < start + n; i++) diffRowUpdated(buf, &buf->row[i]);
+    editorHighlightRows(buf, start, n);
+
+    filterRefresh(buf);
+    buf->version++;
+    buf->dirty++;
+}
+
+void editorSortRows(editorBuffer *buf, ssize_t start, ssize_t end, lineSortOptions *opt) {
+    ssize_t n = end - start;
+    lineSortKey *keys = memMalloc(MEM_TEXT, sizeof(lineSortKey) * (n ? n : 1));
+    opt->rows = &buf->row[start];
+    opt->fields = memMalloc(MEM_TEXT, sizeof(lineSortField) * (n ? n : 1));
+    if (keys == NULL || opt->fields == NULL) die("malloc");
+
+    lineSortParallel(keys, n, opt);
+
+    editorRow *rows = memMalloc(MEM_TEXT, sizeof(editorRow) * (n ? n : 1));
+    if (rows == NULL) die("malloc");
+    undoStep *step = undoPush(buf, start, n);
+    for (ssize_t i = 0; i < n; i++) {
+        rows[i] = buf->row[start + keys[i].pos];
+        step->order[i] = keys[i].pos;
+    }
+    memcpy(&buf->row[start], rows, sizeof(editorRow) * n);
+    memFree(MEM_TEXT, rows);
+    memFree(MEM_TEXT, opt->fields);
+    memFree(MEM_TEXT, keys);
+
+    editorRowsMoved(buf, start, n);
+    step->after = buf->version;
+}
+
+// Drops rows equal to the row before them, like uniq(1).
+void editorUniqueRows(editorBuffer *buf, ssize_t start, ssize_t end) {
+    undoStep *step = undoPush(buf, start, end - start);
+
+    ssize_t kept = 0;
+    for (ssize_t i = start; i < end; i++) {
+        editorRow *row = &buf->row[i];
+        editorRow *prev = kept ? &buf->row[start + kept - 1] : NULL;
+        if (prev && prev->size == row->size && !memcmp(prev->chars, row->chars, row->size)) {
+            if (step->numdropped % 1024 == 0) {
+                step->dropped = memRealloc(MEM_UNDO, step->dropped, sizeof(editorRow) * (step->numdropped + 1024));
+                step->droppedAt = memRealloc(MEM_UNDO, step->droppedAt, sizeof(ssize_t) * (step->numdropped + 1024));
+                if (step->dropped == NULL || step->droppedAt == NULL) die("realloc");
+            }
+            step->dropped[step->numdropped] = *row;
+            step->droppedAt[step->numdropped++] = i - start;
+            continue;
+        }
+        buf->row[start + kept] = *row;
+        step->order[kept++] = i - start;
+    }
+
+    memmove(&buf->row[start + kept], &buf->row[end], sizeof(editorRow) * (buf->numrows - end));
+    diffRowsDeleted(buf, start + kept, end - start - kept);
+    buf->numrows -= end - start - kept;
+    step->numrows = kept;
+
+    editorRowsMoved(buf, start, kept);
+    step->after = buf->version;
+}
+
+void editorReverseRows(editorBuffer *buf, ssize_t start, ssize_t end) {
+    ssize_t n = end - start;
+    undoStep *step = undoPush(buf, start, n);
+    for (ssize_t i = 0; i < n / 2; i++) {
+        editorRow row = buf->row[start + i];
+        buf->row[start + i] = buf->row[end - 1 - i];
+        buf->row[end - 1 - i] = row;
+    }
+    for (ssize_t i = 0; i < n; i++) step->order[i] = n - 1 - i;
+
+    editorRowsMoved(buf, start, n);
+    step->after = buf->version;
+}
+
+// Only line operations are undoable, and only while no row has changed since.
+void editorUndo(editorBuffer *buf) {
+    if (buf->numundo == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    undoStep *step = &buf->undo[buf->numundo - 1];
+    if (step->after != buf->version) {
+        undoClear(buf);
+        editorSetStatusMessage("Can't undo, the rows have changed since");
+        return;
+    }
+
+    ssize_t total = step->numrows + step->numdropped;
+    editorRow *rows = memMalloc(MEM_UNDO, sizeof(editorRow) * (total ? total : 1));
+    if (rows == NULL) die("malloc");
+    for (ssize_t i = 0; i < step->numrows; i++) rows[step->order[i]] = buf->row[step->start + i];
+    for (ssize_t i = 0; i < step->numdropped; i++) rows[step->droppedAt[i]] = step->dropped[i];
+
+    if (buf->numrows + step->numdropped > buf->rowcap) {
+        buf->rowcap = buf->numrows + step->numdropped;
+        buf->row = memRealloc(MEM_TEXT, buf->row, sizeof(editorRow) * buf->rowcap);
+        if (buf->row == NULL) die("realloc");
+    }
+    ssize_t end = step->start + step->numrows;
+    memmove(&buf->row[end + step->numdropped], &buf->row[end], sizeof(editorRow) * (buf->numrows - end));
+    memcpy(&buf->row[step->start], rows, sizeof(editorRow) * total);
+    diffRowsInserted(buf, end, step->numdropped);
+    buf->numrows += step->numdropped;
+    memFree(MEM_UNDO, rows);
+
+    // the dropped rows are back in the buffer, so free only the bookkeeping
+    ssize_t start = step->start;
+    unsigned long long before = step->before;
+    step->numdropped = 0;
+    undoDiscard(buf, step);
+    buf->numundo--;
+
+    editorRowsMoved(buf, start, total);
+    // the step below applies again if nothing happened between the two
+    if (buf->numundo > 0 && buf->undo[buf->numundo - 1].after == before)
+        buf->undo[buf->numundo - 1].after = buf->version;
+    editorSetStatusMessage("Undid the last line operation");
+}
+
+void editorLineCommand(void) {
+    editorView *v = E.view;
+    char *cmd = editorPrompt("Lines: %s (sort [-nr] [-k N] [-t C] | uniq | reverse)", NULL);
+    if (cmd == NULL) {
+        editorSetStatusMessage("Line operation aborted");
+        return;
+    }
+
+    ssize_t start, end;
+    editorMarkedRows(v, &start, &end);
+    long long began = perfNow();
+
+    char *word = strtok(cmd, " ");
+    if (word && !strcmp(word, "sort")) {
+        lineSortOptions opt = { 0, 0, 0, 0, NULL, NULL, 0 };
+        while ((word = strtok(NULL, " ")) != NULL) {
+            if (!strcmp(word, "-k") && (word = strtok(NULL, " "))) opt.column = atoi(word);
+            else if (!strcmp(word, "-t") && (word = strtok(NULL, " "))) opt.delim = word[0];
+            else if (word[0] == '-' && strspn(word + 1, "nr") == strlen(word + 1)) {
+                if (strchr(word, 'n')) opt.numeric = 1;
+                if (strchr(word, 'r')) opt.reverse = 1;
+            } else break;
+        }
+        if (word || opt.column < 0) {
+            editorSetStatusMessage("Usage: sort [-nr] [-k N] [-t C]");
+            free(cmd);
+            return;
+        }
+        editorSortRows(v->buf, start, end, &opt);
+    } else if (word && !strcmp(word, "uniq")) {
+        editorUniqueRows(v->buf, start, end);
+    } else if (word && !strcmp(word, "reverse")) {
+        editorReverseRows(v->buf, start, end);
+    } else {
+        editorSetStatusMessage("Unknown line operation");
+        free(cmd);
+        return;
+    }
+    free(cmd);
+
+    v->marked = 0;
+    editorSetStatusMessage("%zd rows in %.2fs (Ctrl-Z to undo)", end - start, (perfNow() - began) / 1e9);
+}
+
+/* CLIPBOARD */
+// Copying keeps (pointer, length) spans into the rows' own text and flags the
+// rows as shared; before a shared row is written or freed, the entries that
+// point into it copy their text out. Cutting hands the removed rows' blocks
+// to the entry instead of freeing them, so neither touches the text.
+void clipEntryFree(clipEntry *e) {
+    if (e->buf)
+        for (ssize_t i = 0; i < e->numspans; i++)
+            if (e->spans[i].cap) storeFree(&e->buf->store, MEM_TEXT, e->spans[i].s, e->spans[i].cap);
+    memFree(MEM_TEXT, e->spans);
+    memFree(MEM_TEXT, e->text);
+    memset(e, 0, sizeof(*e));
+}
+
+void clipCopyOut(clipEntry *e) {
+    if (e->buf == NULL) return;
+
+    e->text = memMalloc(MEM_TEXT, e->bytes + 1);
+    if (e->text == NULL) die("malloc");
+    char *p = e->text;
+    for (ssize_t i = 0; i < e->numspans; i++) {
+        clipSpan *span = &e->spans[i];
+        if (span->len) memcpy(p, span->s, span->len);
+        if (span->cap) storeFree(&e->buf->store, MEM_TEXT, span->s, span->cap);
+        span->s = p;
+        span->cap = 0;
+        p += span->len;
+    }
+    e->buf = NULL;
+}
+
+// Called before a shared row changes, or with NULL before all of a buffer's
+// rows go. Entries are copied out oldest first, since a newer cut may own a
+// block an older copy still points into.
+void clipRelease(editorBuffer *buf, editorRow *row) {
+    for (int i = 0; i < E.clip.num; i++) {
+        clipEntry *e = &E.clip.entries[i];
+        if (e->buf != buf) continue;
+
+        int uses = row == NULL;
+        for (ssize_t j = 0; j < e->numspans && !uses; j++)
+            uses = e->spans[j].s >= row->chars && e->spans[j].s < row->chars + row->capacity;
+        if (uses) clipCopyOut(e);
+    }
+    if (row) row->shared = 0;
+}
+
+clipEntry *clipPush(editorBuffer *buf, ssize_t numspans) {
+    clipRing *r = &E.clip;
+    if (r->num == KILO_KILL_RING) {
+        clipEntryFree(&r->entries[0]);
+        memmove(&r->entries[0], &r->entries[1], sizeof(clipEntry) * (KILO_KILL_RING - 1));
+        r->num--;
+    }
+
+    clipEntry *e = &r->entries[r->num++];
+    memset(e, 0, sizeof(*e));
+    e->buf = buf;
+    e->spans = memCalloc(MEM_TEXT, numspans, sizeof(clipSpan));
+    if (e->spans == NULL) die("calloc");
+    e->numspans = numspans;
+    e->bytes = numspans - 1;
+    r->yankBuf = NULL;
+
+    return e;
+}
+
+// The text between the mark and the cursor, or the cursor's line without a
+// mark. Returns 0 when that is empty.
+int clipSelection(editorView *v, ssize_t *y0, ssize_t *x0, ssize_t *y1, ssize_t *x1) {
+    editorBuffer *buf = v->buf;
+    if (!v->marked) {
+        if (v->cy >= buf->numrows) return 0;
+        *y0 = v->cy;
+        *x0 = 0;
+        *y1 = v->cy + 1;
+        *x1 = 0;
+        return 1;
+    }
+
+    ssize_t my = v->marky < buf->numrows ? v->marky : buf->numrows;
+    ssize_t mx = my < buf->numrows ? v->markx : 0;
+    if (my < buf->numrows && mx > buf->row[my].size) mx = buf->row[my].size;
+
+    if (my < v->cy || (my == v->cy && mx < v->cx)) {
+        *y0 = my;
+        *x0 = mx;
+        *y1 = v->cy;
+        *x1 = v->cx;
+    } else {
+        *y0 = v->cy;
+        *x0 = v->cx;
+        *y1 = my;
+        *x1 = mx;
+    }
+    // the row a selection starts inside keeps its line break, so one running
+    // past the last row really ends at the end of it
+    if (*y1 == buf->numrows && *x0 > 0) {
+        *y1 = buf->numrows - 1;
+        *x1 = buf->row[*y1].size;
+    }
+
+    return *y0 != *y1 || *x0 != *x1;
+}
+
+void clipCollect(editorBuffer *buf, clipEntry *e, ssize_t y0, ssize_t x0, ssize_t y1, ssize_t x1) {
+    for (ssize_t y = y0; y <= y1; y++) {
+        clipSpan *span = &e->spans[y - y0];
+        if (y == buf->numrows) {
+            span->s = "";
+            continue;
+        }
+
+        editorRow *row = &buf->row[y];
+        ssize_t from = y == y0 ? x0 : 0;
+        ssize_t to = y == y1 ? x1 : row->size;
+        span->s = &row->chars[from];
+        span->len = to - from;
+        e->bytes += span->len;
+        row->shared = 1;
+    }
+}
+
+void clipKeep(editorBuffer *buf, clipSpan *span, char *s, ssize_t len) {
+    span->s = storeAlloc(&buf->store, MEM_TEXT, len + 1, &span->cap);
+    memcpy(span->s, s, len);
+    span->len = len;
+}
+
+// Moves a row's text block into the entry; the row is about to be deleted.
+void clipTake(clipSpan *span, editorRow *row, ssize_t len) {
+    span->s = row->chars;
+    span->len = len;
+    span->cap = row->capacity;
+    row->chars = NULL;
+    row->capacity = 0;
+    row->shared = 0;
+}
+
+// Deletes the text between two positions. With an entry the text moves into
+// it: the rows in between hand over their blocks and only the part of the
+// first row is copied.
+void clipRemove(editorBuffer *buf, clipEntry *e, ssize_t y0, ssize_t x0, ssize_t y1, ssize_t x1) {
+    if (x0 == 0 && x1 == 0 && y1 > y0) {
+        // whole rows, which hand over their blocks and leave the row at y1 as it is
+        if (e) {
+            for (ssize_t y = y0; y < y1; y++) {
+                clipTake(&e->spans[y - y0], &buf->row[y], buf->row[y].size);
+                e->bytes += e->spans[y - y0].len;
+            }
+            e->spans[y1 - y0].s = "";
+        }
+        editorDeleteRows(buf, y0, y1 - y0);
+        return;
+    }
+
+    editorRow *first = &buf->row[y0];
+    if (first->shared) clipRelease(buf, first);
+
+    if (y0 == y1) {
+        if (e) clipKeep(buf, &e->spans[0], &first->chars[x0], x1 - x0);
+        memmove(&first->chars[x0], &first->chars[x1], first->size - x1 + 1);
+        first->size -= x1 - x0;
+    } else {
+        if (e) clipKeep(buf, &e->spans[0], &first->chars[x0], first->size - x0);
+        first->size = x0;
+        if (y1 < buf->numrows) {
+            // the rest of the last row joins the first
+            editorRow *last = &buf->row[y1];
+            ssize_t rest = last->size - x1;
+            first->chars = storeReserve(&buf->store, MEM_TEXT, first->chars, &first->capacity, x0, x0 + rest + 1);
+            memcpy(&first->chars[x0], &last->chars[x1], rest);
+            first->size += rest;
+        }
+        first->chars[first->size] = '\0';
+
+        ssize_t end = y1 < buf->numrows ? y1 : buf->numrows - 1;
+        if (e) {
+            for (ssize_t y = y0 + 1; y <= end; y++) {
+                editorRow *row = &buf->row[y];
+                clipTake(&e->spans[y - y0], row, y < y1 ? row->size : x1);
+            }
+            if (y1 == buf->numrows) e->spans[y1 - y0].s = "";
+        }
+        editorDeleteRows(buf, y0 + 1, end - y0);
+    }
+
+    if (e)
+        for (ssize_t i = 0; i < e->numspans; i++) e->bytes += e->spans[i].len;
+    editorUpdateRow(buf, &buf->row[y0]);
+    buf->dirty++;
+}
+
+// Pastes an entry in one go: the row at the position is split once, the new
+// rows are opened together and highlighted in order at the end.
+void clipInsert(editorBuffer *buf, clipEntry *e, ssize_t y, ssize_t x, ssize_t *endy, ssize_t *endx) {
+    ssize_t last = e->numspans - 1;
+    clipSpan *head = &e->spans[0];
+    clipSpan *tail = &e->spans[last];
+    *endy = y + last;
+    *endx = last ? tail->len : x + head->len;
+
+    int defer = buf->deferHighlight;
+    if (y == buf->numrows && last > 0 && tail->len == 0) {
+        // whole lines at the end of the buffer have no row to split
+        buf->deferHighlight = 1;
+        editorOpenRows(buf, y, last);
+        for (ssize_t i = 0; i < last; i++) editorSetRow(buf, y + i, e->spans[i].s, e->spans[i].len);
+        buf->deferHighlight = defer;
+        editorHighlightRows(buf, y, last);
+        return;
+    }
+
+    if (y == buf->numrows) editorInsertRow(buf, buf->numrows, "", 0);
+    editorRow *row = &buf->row[y];
+    if (row->shared) clipRelease(buf, row);
+    ssize_t rest = row->size - x;
+
+    if (last == 0) {
+        row->chars = storeReserve(&buf->store, MEM_TEXT, row->chars, &row->capacity, row->size + 1, row->size + head->len + 1);
+        memmove(&row->chars[x + head->len], &row->chars[x], rest + 1);
+        memcpy(&row->chars[x], head->s, head->len);
+        row->size += head->len;
+        editorUpdateRow(buf, row);
+        buf->dirty++;
+        return;
+    }
+
+    // the last line gets the rest of the split row
+    char *joined = memMalloc(MEM_TEXT, tail->len + rest + 1);
+    if (joined == NULL) die("malloc");
+    memcpy(joined, tail->s, tail->len);
+    memcpy(&joined[tail->len], &row->chars[x], rest);
+
+    row->chars = storeReserve(&buf->store, MEM_TEXT, row->chars, &row->capacity, x, x + head->len + 1);
+    memcpy(&row->chars[x], head->s, head->len);
+    row->size = x + head->len;
+    row->chars[row->size] = '\0';
+
+    buf->deferHighlight = 1;
+    editorUpdateRow(buf, row);
+    editorOpenRows(buf, y + 1, last);
+    for (ssize_t i = 1; i < last; i++) editorSetRow(buf, y + i, e->spans[i].s, e->spans[i].len);
+    editorSetRow(buf, y + last, joined, tail->len + rest);
+    buf->deferHighlight = defer;
+    memFree(MEM_TEXT, joined);
+
+    editorHighlightRows(buf, y, last + 1);
+    buf->dirty++;
+}
+
+// Small selections also go to the terminal's clipboard with OSC 52, which
+// reaches the local desktop through ssh and tmux.
+void clipOsc52(clipEntry *e) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    if (E.replay.active || e->bytes > CLIP_OSC52_MAX) return;
+
+    unsigned char *text = memMalloc(MEM_TEXT, e->bytes + 1);
+    char *out = memMalloc(MEM_FRAME, 4 * (e->bytes / 3 + 1) + 16);
+    if (text == NULL || out == NULL) die("malloc");
+    size_t len = 0;
+    for (ssize_t i = 0; i < e->numspans; i++) {
+        if (i > 0) text[len++] = '\n';
+        memcpy(&text[len], e->spans[i].s, e->spans[i].len);
+        len += e->spans[i].len;
+    }
+
+    size_t n = 0;
+    memcpy(out, "\x1b]52;c;", 7);
+    n += 7;
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned int group = text[i] << 16;
+        if (i + 1 < len) group |= text[i + 1] << 8;
+        if (i + 2 < len) group |= text[i + 2];
+        out[n++] = digits[(group >> 18) & 63];
+        out[n++] = digits[(group >> 12) & 63];
+        out[n++] = i + 1 < len ? digits[(group >> 6) & 63] : '=';
+        out[n++] = i + 2 < len ? digits[group & 63] : '=';
+    }
+    out[n++] = '\a';
+    write(STDOUT_FILENO, out, n);
+
+    memFree(MEM_TEXT, text);
+    memFree(MEM_FRAME, out);
+}
+
+void clipYank(editorView *v) {
+    clipRing *r = &E.clip;
+    editorBuffer *buf = v->buf;
+    clipEntry *e = &r->entries[r->yank];
+
+    r->yanky = v->cy;
+    r->yankx = v->cx;
+    clipInsert(buf, e, v->cy, v->cx, &v->cy, &v->cx);
+    r->yankBuf = buf;
+    r->yankVersion = buf->version;
+    r->yankendy = v->cy;
+    r->yankendx = v->cx;
+
+    editorSetStatusMessage("Pasted %zu bytes (%d of %d, Ctrl-Y for an older one)", e->bytes, r->num - r->yank, r->num);
+}
+
+void editorCopy(editorView *v) {
+    ssize_t y0, x0, y1, x1;
+    if (!clipSelection(v, &y0, &x0, &y1, &x1)) {
+        editorSetStatusMessage("Nothing to copy");
+        return;
+    }
+
+    clipEntry *e = clipPush(v->buf, y1 - y0 + 1);
+    clipCollect(v->buf, e, y0, x0, y1, x1);
+    clipOsc52(e);
+    v->marked = 0;
+    editorSetStatusMessage("Copied %zu bytes", e->bytes);
+}
+
+void editorCut(editorView *v) {
+    ssize_t y0, x0, y1, x1;
+    if (!clipSelection(v, &y0, &x0, &y1, &x1)) {
+        editorSetStatusMessage("Nothing to cut");
+        return;
+    }
+
+    clipEntry *e = clipPush(v->buf, y1 - y0 + 1);
+    clipRemove(v->buf, e, y0, x0, y1, x1);
+    clipOsc52(e);
+    v->cy = y0;
+    v->cx = x0;
+    v->marked = 0;
+    editorSetStatusMessage("Cut %zu bytes", e->bytes);
+}
+
+void editorPaste(editorView *v) {
+    if (E.clip.num == 0) {
+        editorSetStatusMessage("Nothing to paste");
+        return;
+    }
+
+    E.clip.yank = E.clip.num - 1;
+    clipYank(v);
+}
+
+// Right after a paste, swaps the pasted text for the next older entry.
+void editorYankPop(editorView *v) {
+    clipRing *r = &E.clip;
+    editorBuffer *buf = v->buf;
+    if (r->yankBuf != buf || r->yankVersion != buf->version) {
+        editorSetStatusMessage("Ctrl-Y only works right after a paste");
+        return;
+    }
+
+    clipRemove(buf, NULL, r->yanky, r->yankx, r->yankendy, r->yankendx);
+    v->cy = r->yanky;
+    v->cx = r->yankx;
+    r->yank = (r->yank + r->num - 1) % r->num;
+    clipYank(v);
+}
+
+/* MULTIPLE CURSORS */
+// Besides its own cursor a view can hold any number of extra ones, kept sorted
+// by position. A key typed with extra cursors is applied to all of them as
+// one batch: every row is rewritten once for all of its cursors, and the rows
+// are highlighted in order once the batch is done.
+int cursorCompare(const void *a, const void *b) {
+    const editorCursor *ca = a;
+    const editorCursor *cb = b;
+    if (ca->y != cb->y) return ca->y < cb->y ? -1 : 1;
+    if (ca->x != cb->x) return ca->x < cb->x ? -1 : 1;
+
+    return 0;
+}
+
+void cursorsClear(editorView *v) {
+    memFree(MEM_TEXT, v->multi.at);
+    memset(&v->multi, 0, sizeof(cursorSet));
+}
+
+void cursorsAdd(editorView *v, ssize_t y, ssize_t x) {
+    cursorSet *m = &v->multi;
+    if (m->num == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        m->at = memRealloc(MEM_TEXT, m->at, sizeof(editorCursor) * m->cap);
+        if (m->at == NULL) die("realloc");
+    }
+    m->at[m->num].y = y;
+    m->at[m->num].x = x;
+    m->num++;
+}
+
+// Sorts the extra cursors and drops those that landed on another cursor.
+void cursorsSort(editorView *v) {
+    cursorSet *m = &v->multi;
+    if (m->num == 0) return;
+    qsort(m->at, m->num, sizeof(editorCursor), cursorCompare);
+
+    ssize_t kept = 0;
+    for (ssize_t i = 0; i < m->num; i++) {
+        editorCursor *c = &m->at[i];
+        if (c->y == v->cy && c->x == v->cx) continue;
+        if (kept > 0 && cursorCompare(c, &m->at[kept - 1]) == 0) continue;
+        m->at[kept++] = *c;
+    }
+    m->num = kept;
+}
+
+// Another view on the same buffer may have removed rows or text under the
+// extra cursors; like editorScroll does for the view's own cursor, they're
+// pulled back into the buffer and those that end up together are merged.
+void cursorsClamp(editorView *v) {
+    editorBuffer *buf = v->buf;
+    cursorSet *m = &v->multi;
+    for (ssize_t i = 0; i < m->num; i++) {
+        editorCursor *c = &m->at[i];
+        if (c->y > buf->numrows) c->y = buf->numrows;
+        if (c->y == buf->numrows) c->x = 0;
+        else if (c->x > buf->row[c->y].size) c->x = buf->row[c->y].size;
+    }
+    cursorsSort(v);
+}
+
+// The first extra cursor on row y or after it.
+ssize_t cursorsFind(editorView *v, ssize_t y) {
+    ssize_t lo = 0;
+    ssize_t hi = v->multi.num;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (v->multi.at[mid].y < y) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+// Display column of the extra cursor at *k if it is on this row, -1 otherwise.
+ssize_t cursorsRx(editorView *v, editorRow *row, ssize_t *k) {
+    if (*k >= v->multi.num || v->multi.at[*k].y != row->idx) return -1;
+
+    ssize_t x = v->multi.at[(*k)++].x;
+    return editorRowCxToRx(row, x < row->size ? x : row->size);
+}
+
+void cursorsMove(editorView *v, int key) {
+    cursorSet *m = &v->multi;
+    editorBuffer *buf = v->buf;
+    cursorsClamp(v);
+    ssize_t cx = v->cx;
+    ssize_t cy = v->cy;
+
+    for (ssize_t i = 0; i <= m->num; i++) {
+        if (i < m->num) {
+            v->cx = m->at[i].x;
+            v->cy = m->at[i].y;
+        } else {
+            v->cx = cx;
+            v->cy = cy;
+        }
+
+        if (key == HOME_KEY) v->cx = 0;
+        else if (key == END_KEY) v->cx = v->cy < buf->numrows ? buf->row[v->cy].size : 0;
+        else editorMoveCursor(v, key);
+
+        if (i < m->num) {
+            m->at[i].x = v->cx;
+            m->at[i].y = v->cy;
+        }
+    }
+
+    m->block = 0;
+    cursorsSort(v);
+}
+
+// Rewrites one row for all the cursors on it, left to right. Each cursor first
+// deletes its range in cut[], which never reaches back past what the cursor
+// before it kept, then the typed byte goes in at every cursor.
+void cursorsEditRow(editorBuffer *buf, editorRow *row, editorCursor *at, ssize_t *cut, ssize_t n, int key) {
+    if (row->shared) clipRelease(buf, row);
+
+    ssize_t w = 0;
+    ssize_t r = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        ssize_t from = cut[2 * i] > r ? cut[2 * i] : r;
+        ssize_t to = cut[2 * i + 1] > from ? cut[2 * i + 1] : from;
+        memmove(&row->chars[w], &row->chars[r], from - r);
+        w += from - r;
+        at[i].x = w;
+        r = to;
+    }
+    memmove(&row->chars[w], &row->chars[r], row->size - r + 1);
+    row->size = w + row->size - r;
+
+    if (key != BACKSPACE && key != DEL_KEY) {
+        row->chars = storeReserve(&buf->store, MEM_TEXT, row->chars, &row->capacity, row->size + 1, row->size + n + 1);
+        // right to left, so every byte moves once
+        ssize_t end = row->size;
+        row->chars[row->size + n] = '\0';
+        for (ssize_t i = n - 1; i >= 0; i--) {
+            ssize_t x = at[i].x;
+            memmove(&row->chars[x + i + 1], &row->chars[x], end - x);
+            row->chars[x + i] = key;
+            end = x;
+            at[i].x = x + i + 1;
+        }
+        row->size += n;
+    }
+
+    editorUpdateRow(buf, row);
+}
+
+void cursorsEdit(editorView *v, int key) {
+    editorBuffer *buf = v->buf;
+    cursorSet *m = &v->multi;
+    int insert = key != BACKSPACE && key != DEL_KEY;
+    cursorsClamp(v);
+
+    // the view's own cursor joins the batch and is picked out again afterwards
+    ssize_t n = m->num + 1;
+    editorCursor *all = memMalloc(MEM_TEXT, sizeof(editorCursor) * n);
+    ssize_t *cut = memMalloc(MEM_TEXT, sizeof(ssize_t) * 2 * n);
+    if (all == NULL || cut == NULL) die("malloc");
+    editorCursor self = { v->cy, v->cx };
+    ssize_t own = 0;
+    while (own < m->num && cursorCompare(&m->at[own], &self) < 0) own++;
+    memcpy(all, m->at, sizeof(editorCursor) * own);
+    all[own] = self;
+    memcpy(&all[own + 1], &m->at[own], sizeof(editorCursor) * (m->num - own));
+
+    if (insert && all[n - 1].y >= buf->numrows) editorInsertRow(buf, buf->numrows, "", 0);
+
+    int defer = buf->deferHighlight;
+    buf->deferHighlight = 1;
+    for (ssize_t i = 0, j; i < n; i = j) {
+        for (j = i; j < n && all[j].y == all[i].y; j++);
+        if (all[i].y >= buf->numrows) continue;
+
+        editorRow *row = &buf->row[all[i].y];
+        ssize_t blockx = m->block ? editorRowRxToCx(row, m->blockrx) : 0;
+        for (ssize_t k = i; k < j; k++) {
+            ssize_t x = all[k].x < row->size ? all[k].x : row->size;
+            ssize_t *c = &cut[2 * (k - i)];
+            c[0] = c[1] = x;
+            if (m->block) c[0] = blockx < x ? blockx : x;
+            else if (key == BACKSPACE && x > 0) c[0] = editorRowPrevCluster(row, x);
+            else if (key == DEL_KEY && x < row->size) c[1] = editorRowNextCluster(row, x);
+        }
+        cursorsEditRow(buf, row, &all[i], cut, j - i, key);
+    }
+    buf->deferHighlight = defer;
+
+    // in order, so a comment a row opens reaches the rows after it before they're redone
+    for (ssize_t i = 0; i < n && buf->syntax; i++)
+        if (all[i].y < buf->numrows && buf->row[all[i].y].hlStale)
+            editorHighlightRow(buf, &buf->row[all[i].y]);
+    buf->dirty++;
+
+    v->cx = all[own].x;
+    v->cy = all[own].y;
+    memcpy(m->at, all, sizeof(editorCursor) * own);
+    memcpy(&m->at[own], &all[own + 1], sizeof(editorCursor) * (n - own - 1));
+    m->block = 0;
+    cursorsSort(v);
+    memFree(MEM_TEXT, all);
+    memFree(MEM_TEXT, cut);
+}
+
+// Leaves a cursor where the view's cursor is and moves it down a row, keeping
+// its column.
+void editorAddCursorBelow(editorView *v) {
+    editorBuffer *buf = v->buf;
+    ssize_t next = filterRow(v, filterLine(v, v->cy) + 1);
+    if (v->cy >= buf->numrows || next >= buf->numrows) {
+        editorSetStatusMessage("No row below for another cursor");
+        return;
+    }
+
+    ssize_t rx = editorRowCxToRx(&buf->row[v->cy], v->cx);
+    cursorsAdd(v, v->cy, v->cx);
+    v->cy = next;
+    v->cx = editorRowRxToCx(&buf->row[next], rx);
+    cursorsSort(v);
+    editorSetStatusMessage("%zd cursors (Esc to leave)", v->multi.num + 1);
+}
+
+// Puts a cursor on every row from the mark to the cursor, in the cursor's
+// column. With the mark in another column the columns in between form a
+// block, which the first edit deletes on every row, so typing replaces it.
+void editorBlockCursors(editorView *v) {
+    editorBuffer *buf = v->buf;
+    if (!v->marked) {
+        editorSetStatusMessage("Set a mark with Ctrl-Space first");
+        return;
+    }
+
+    ssize_t top = v->marky < v->cy ? v->marky : v->cy;
+    ssize_t bottom = v->marky < v->cy ? v->cy : v->marky;
+    ssize_t markrx = 0;
+    if (v->marky < buf->numrows) {
+        editorRow *row = &buf->row[v->marky];
+        markrx = editorRowCxToRx(row, v->markx < row->size ? v->markx : row->size);
+    }
+    ssize_t rx = v->cy < buf->numrows ? editorRowCxToRx(&buf->row[v->cy], v->cx) : 0;
+    ssize_t left = markrx < rx ? markrx : rx;
+    ssize_t right = markrx < rx ? rx : markrx;
+
+    cursorsClear(v);
+    for (ssize_t line = filterLine(v, top); line <= filterLine(v, bottom); line++) {
+        ssize_t y = filterRow(v, line);
+        if (y >= buf->numrows) break;
+        cursorsAdd(v, y, editorRowRxToCx(&buf->row[y], right));
+    }
+    if (v->cy < buf->numrows) v->cx = editorRowRxToCx(&buf->row[v->cy], right);
+    v->multi.block = left < right;
+    v->multi.blockrx = left;
+    v->marked = 0;
+    cursorsSort(v);
+    editorSetStatusMessage("%zd cursors%s (Esc to leave)", v->multi.num + 1,
+                           v->multi.block ? ", typing replaces the block" : "");
+}
+
+// Keys while a view has extra cursors. Returns 0 for keys that end multi-cursor
+// editing, which the caller then handles as usual.
+int editorCursorsKey(editorView *v, int c) {
+    switch (c) {
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            cursorsMove(v, c);
+            return 1;
+
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            cursorsEdit(v, BACKSPACE);
+            return 1;
+
+        case DEL_KEY:
+            cursorsEdit(v, DEL_KEY);
+            return 1;
+
+        case CTRL_KEY('d'):
+            editorAddCursorBelow(v);
+            return 1;
+
+        case '\x1b':
+            cursorsClear(v);
+            editorSetStatusMessage("Back to one cursor");
+            return 1;
+    }
+
+    if (c == '\t' || (c < ARROW_LEFT && !iscntrl(c))) {
+        cursorsEdit(v, c);
+        return 1;
+    }
+    cursorsClear(v);
+
+    return 0;
+}
+
+/* BUFFERS AND VIEWS */
+// A buffer owns the rows, highlighting and file state; a view is a cursor and
+// scroll position onto a buffer. Views on the same buffer share its rows, so
+// splitting a window costs only the view struct.
+editorBuffer *editorNewBuffer(void) {
+    editorBuffer *buf = memCalloc(MEM_TEXT, 1, sizeof(editorBuffer));
+    if (buf == NULL) die("calloc");
+    buf->streamfd = -1;
+    if (pipe2(buf->diff.wakefd, O_CLOEXEC | O_NONBLOCK) == -1) die("pipe");
+
+    E.buffers = memRealloc(MEM_TEXT, E.buffers, sizeof(editorBuffer *) * (E.numbuffers + 1));
+    if (E.buffers == NULL) die("realloc");
+    E.buffers[E.numbuffers++] = buf;
+
+    return buf;
+}
+
+editorBuffer *editorFindBuffer(char *filename) {
+    for (int i = 0; i < E.numbuffers; i++)
+        if (E.buffers[i]->filename && !strcmp(E.buffers[i]->filename, filename))
+            return E.buffers[i];
+
+    return NULL;
+}
+
+void editorShowBuffer(editorView *v, editorBuffer *buf) {
+    filterSet(v, NULL);
+    cursorsClear(v);
+    v->buf = buf;
+    v->cx = 0;
+    v->cy = 0;
+    v->rx = 0;
+    v->rowoff = 0;
+    v->coloff = 0;
+}
+
+// Stack the views top to bottom, each getting its share of the text area plus
+// one line for its own status bar.
+void editorLayoutViews(void) {
+    int top = 0;
+    for (int i = 0; i < E.numviews; i++) {
+        int height = E.screenrows / E.numviews;
+        if (i == E.numviews - 1) height = E.screenrows - top;
+
+        E.views[i].top = top;
+        E.views[i].screenrows = height > 1 ? height - 1 : 0;
+        E.views[i].screencols = E.screencols - KILO_GUTTER;
+        top += height;
+    }
+}
+
+void editorSplitView(void) {
+    if (E.numviews == KILO_MAX_VIEWS || E.screenrows / (E.numviews + 1) < 2) {
+        editorSetStatusMessage("No room for another view");
+        return;
+    }
+
+    int cur = E.view - E.views;
+    memmove(&E.views[cur + 1], &E.views[cur], sizeof(editorView) * (E.numviews - cur));
+    E.numviews++;
+    E.view = &E.views[cur + 1];
+    // the copy starts unfiltered with one cursor, the rest stays with the original view
+    memset(&E.view->filter, 0, sizeof(lineFilter));
+    memset(&E.view->multi, 0, sizeof(cursorSet));
+    editorLayoutViews();
+}
+
+void editorCloseView(void) {
+    if (E.numviews == 1) {
+        editorSetStatusMessage("Can't close the last view");
+        return;
+    }
+
+    int cur = E.view - E.views;
+    filterSet(E.view, NULL);
+    cursorsClear(E.view);
+    memmove(&E.views[cur], &E.views[cur + 1], sizeof(editorView) * (E.numviews - cur - 1));
+    E.numviews--;
+    if (cur == E.numviews) cur--;
+    E.view = &E.views[cur];
+    editorLayoutViews();
+}
+
+void editorNextView(void) {
+    int cur = E.view - E.views;
+    E.view = &E.views[(cur + 1) % E.numviews];
+}
+
+void editorNextBuffer(void) {
+    int cur = 0;
+    while (E.buffers[cur] != E.view->buf) cur++;
+    editorShowBuffer(E.view, E.buffers[(cur + 1) % E.numbuffers]);
+}
+
+/* LINE CACHE */
+// Reopening a large file skips the newline scan and the full highlighting pass
+// by reading a sidecar holding every line's offset and the multi-line comment
+// state at the end of every line. It is keyed by path, size, mtime and inode,
+// so any change to the file on disk invalidates it.
+int cachePath(const char *filename, char *out, size_t outlen) {
+    char *real = realpath(filename, NULL);
+    if (real == NULL) return -1;
+
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (char *p = real; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 0x100000001b3ULL;
+    }
+    free(real);
+
+    char dir[PATH_MAX];
+    char *xdg = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home && *home) snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else return -1;
+
+    mkdir(dir, 0700);
+    if ((size_t)snprintf(out, outlen, "%s/kilo", dir) >= outlen) return -1;
+    mkdir(out, 0700);
+    if ((size_t)snprintf(out, outlen, "%s/kilo/%016llx.idx", dir, hash) >= outlen) return -1;
+
+    return 0;
+}
+
+int cacheLoad(editorBuffer *buf, const char *filename) {
+    char path[PATH_MAX];
+    struct stat st, cst;
+    if (stat(filename, &st) == -1 || cachePath(filename, path, sizeof(path)) == -1) return 0;
+
+    int cfd = open(path, O_RDONLY);
+    if (cfd == -1) return 0;
+    if (fstat(cfd, &cst) == -1 || (size_t)cst.st_size < sizeof(lineCacheHeader)) {
+        close(cfd);
+        return 0;
+    }
+    char *map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+    close(cfd);
+    if (map == MAP_FAILED) return 0;
+
+    lineCacheHeader *h = (lineCacheHeader *)map;
+    char *real = realpath(filename, NULL);
+    size_t pathlen = real ? strlen(real) : 0;
+    size_t pathpad = (h->pathlen + 7) & ~(size_t)7;
+    int valid = real && !memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) &&
+        h->size == (uint64_t)st.st_size && h->mtimeSec == st.st_mtim.tv_sec &&
+        h->mtimeNsec == st.st_mtim.tv_nsec && h->ino == st.st_ino && h->dev == st.st_dev &&
+        h->pathlen == pathlen && h->numrows < (uint64_t)cst.st_size &&
+        (uint64_t)cst.st_size == sizeof(*h) + pathpad + (h->numrows + 1) * 8 + (h->numrows + 7) / 8 &&
+        !memcmp(map + sizeof(*h), real, pathlen);
+    free(real);
+
+    uint64_t *offsets = (uint64_t *)(map + sizeof(*h) + pathpad);
+    unsigned char *states = (unsigned char *)&offsets[valid ? h->numrows + 1 : 0];
+    if (!valid || offsets[h->numrows] != h->size) {
+        munmap(map, cst.st_size);
+        return 0;
+    }
+
+    char *data = NULL;
+    if (h->size) {
+        int fd = open(filename, O_RDONLY);
+        if (fd != -1) {
+            data = mmap(NULL, h->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+        }
+        if (data == NULL || data == MAP_FAILED) {
+            munmap(map, cst.st_size);
+            return 0;
+        }
+    }
+
+    // rows keep the comment state from the cache and highlight when first shown
+    buf->deferHighlight = 1;
+    buf->store.exact = 1;
+    for (uint64_t i = 0; i < h->numrows; i++) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > h->size) {
+            valid = 0;
+            break;
+        }
+        char *line = data + offsets[i];
+        ssize_t linelen = offsets[i + 1] - offsets[i];
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+        editorInsertRow(buf, buf->numrows, line, linelen);
+        buf->row[i].hlOpenComment = (states[i >> 3] >> (i & 7)) & 1;
+    }
+    buf->deferHighlight = 0;
+    buf->store.exact = 0;
+
+    if (data) munmap(data, h->size);
+    munmap(map, cst.st_size);
+    if (!valid) editorFreeRows(buf);
+
+    return valid;
+}
+
+// Offsets are passed in when the rows were read from disk, since stripped
+// line endings can't be recovered from the rows. Otherwise the file was just
+// written from the rows with one '\n' per line.
+void cacheStore(editorBuffer *buf, const char *filename, const uint64_t *offsets) {
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    struct stat st;
+    if (stat(filename, &st) == -1 || st.st_size < KILO_CACHE_MIN_BYTES) return;
+    if (cachePath(filename, path, sizeof(path)) == -1) return;
+
+    char *real = realpath(filename, NULL);
+    if (real == NULL) return;
+
+    lineCacheHeader h;
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.size = st.st_size;
+    h.mtimeSec = st.st_mtim.tv_sec;
+    h.mtimeNsec = st.st_mtim.tv_nsec;
+    h.ino = st.st_ino;
+    h.dev = st.st_dev;
+    h.numrows = buf->numrows;
+    h.pathlen = strlen(real);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        free(real);
+        return;
+    }
+
+    static const char pad[8] = {0};
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(real, 1, h.pathlen, fp);
+    fwrite(pad, 1, ((h.pathlen + 7) & ~(uint64_t)7) - h.pathlen, fp);
+    free(real);
+
+    uint64_t off = 0;
+    for (ssize_t i = 0; i <= buf->numrows; i++) {
+        if (offsets) off = offsets[i];
+        fwrite(&off, sizeof(off), 1, fp);
+        if (i < buf->numrows) off += buf->row[i].size + 1;
+    }
+
+    unsigned char bits = 0;
+    for (ssize_t i = 0; i < buf->numrows; i++) {
+        if (buf->row[i].hlOpenComment) bits |= 1 << (i & 7);
+        if ((i & 7) == 7 || i == buf->numrows - 1) {
+            fputc(bits, fp);
+            bits = 0;
+        }
+    }
+
+    if (fclose(fp) == 0 && rename(tmp, path) == 0) return;
+    unlink(tmp);
+}
+
+/* COMPRESSED FILES */
+// Compressed files go through gzip or zstd running as a child process, so no
+// compression library has to be linked in. editorOpen reads only the first
+// screen of rows and the rest is appended from editorReadKey while it waits for
+// input. Saving forks a child that compresses its copy-on-write snapshot of the
+// rows, so editing carries on while it runs.
+editorCompressor *compressorForFile(const char *filename) {
+    unsigned char magic[4];
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return NULL;
+    ssize_t n = read(fd, magic, sizeof(magic));
+    close(fd);
+
+    for (unsigned int i = 0; i < COMPRESSORS_ENTRIES; i++) {
+        editorCompressor *c = &COMPRESSORS[i];
+        if (n >= c->magiclen && !memcmp(magic, c->magic, c->magiclen)) return c;
+    }
+
+    return NULL;
+}
+
+editorCompressor *compressorForName(const char *filename) {
+    char *ext = strrchr(filename, '.');
+    if (ext == NULL) return NULL;
+
+    for (unsigned int i = 0; i < COMPRESSORS_ENTRIES; i++)
+        if (!strcmp(ext, COMPRESSORS[i].suffix)) return &COMPRESSORS[i];
+
+    return NULL;
+}
+
+// Callers open their pipes with O_CLOEXEC, so the child keeps only the two
+// descriptors it is handed here.
+pid_t compressorSpawn(char **argv, int infd, int outfd) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    dup2(infd, STDIN_FILENO);
+    dup2(outfd, STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull != -1) dup2(devnull, STDERR_FILENO);
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+void streamOpen(editorBuffer *buf, editorCompressor *c) {
+    int in = open(buf->filename, O_RDONLY | O_CLOEXEC);
+    if (in == -1) die("open");
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) die("pipe");
+
+    buf->streampid = compressorSpawn(c->decompress, in, fds[1]);
+    close(in);
+    close(fds[1]);
+    if (buf->streampid == -1) die("fork");
+    buf->streamfd = fds[0];
+
+    // block until the first screen is there, the rest arrives in the background
+    while (buf->streamfd != -1 && buf->numrows < E.screenrows) streamRead(buf);
+    if (buf->streamfd != -1) fcntl(buf->streamfd, F_SETFL, O_NONBLOCK);
+}
+
+// Appends every complete line in the next chunk of decompressor output and keeps
+// the partial last line for the next call. Returns the number of rows added.
+ssize_t streamRead(editorBuffer *buf) {
+    if (buf->pendingcap - buf->pendinglen < STREAM_CHUNK) {
+        buf->pendingcap = buf->pendinglen + STREAM_CHUNK;
+        buf->pending = memRealloc(MEM_TEXT, buf->pending, buf->pendingcap);
+        if (buf->pending == NULL) die("realloc");
+    }
+
+    ssize_t n = read(buf->streamfd, buf->pending + buf->pendinglen, STREAM_CHUNK);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+
+    // streamed rows are part of the file, not edits
+    ssize_t numrows = buf->numrows;
+    int dirty = buf->dirty;
+    buf->store.exact = 1;
+    buf->diff.loading = 1;
+    if (n > 0) {
+        buf->pendinglen += n;
+        char *start = buf->pending;
+        char *end = buf->pending + buf->pendinglen;
+        char *nl;
+        while ((nl = memchr(start, '\n', end - start)) != NULL) {
+            size_t len = nl - start;
+            while (len > 0 && start[len - 1] == '\r') len--;
+            editorInsertRow(buf, buf->numrows, start, len);
+            start = nl + 1;
+        }
+        buf->pendinglen = end - start;
+        memmove(buf->pending, start, buf->pendinglen);
+        diffAppendBase(buf, numrows);
+    } else {
+        // the last line has no newline
+        size_t len = buf->pendinglen;
+        while (len > 0 && buf->pending[len - 1] == '\r') len--;
+        if (buf->pendinglen > 0) editorInsertRow(buf, buf->numrows, buf->pending, len);
+        diffAppendBase(buf, numrows);
+        if (streamClose(buf) == -1)
+            editorSetStatusMessage("Can't decompress %s, showing what was read", buf->filename);
+    }
+    buf->dirty = dirty;
+    buf->store.exact = 0;
+    buf->diff.loading = 0;
+
+    return buf->numrows - numrows;
+}
+
+int streamClose(editorBuffer *buf) {
+    if (buf->streamfd == -1) return 0;
+
+    close(buf->streamfd);
+    buf->streamfd = -1;
+    memFree(MEM_TEXT, buf->pending);
+    buf->pending = NULL;
+    buf->pendinglen = 0;
+    buf->pendingcap = 0;
+
+    int status;
+    if (waitpid(buf->streampid, &status, 0) == -1) return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Runs in the forked child: pipes the rows through the compressor into a
+// temporary file and renames it over the original once it is complete.
+int streamCompress(editorBuffer *buf, editorCompressor *c) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.kilo-save", buf->filename) >= (int)sizeof(tmp)) return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1) return 1;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) return 1;
+    pid_t pid = compressorSpawn(c->compress, fds[0], out);
+    close(fds[0]);
+    close(out);
+
+    char *chunk = memMalloc(MEM_TEXT, SAVE_CHUNK);
+    int ok = pid != -1 && chunk != NULL && editorWriteRows(buf, fds[1], chunk) == 0;
+    close(fds[1]);
+
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ok = 0;
+    if (ok && rename(tmp, buf->filename) == 0) return 0;
+    unlink(tmp);
+    return 1;
+}
+
+void streamSave(editorBuffer *buf, editorCompressor *c) {
+    if (buf->savepid > 0) {
+        editorSetStatusMessage("Still compressing the last save of %s", buf->filename);
+        return;
+    }
+    if (buf->streamfd != -1) {
+        editorSetStatusMessage("Can't save %s until it has finished loading", buf->filename);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        editorSetStatusMessage("Can't save! fork: %s", strerror(errno));
+        return;
+    }
+    if (pid == 0) _exit(streamCompress(buf, c));
+
+    buf->savepid = pid;
+    buf->saveDirty = buf->dirty;
+    editorSetStatusMessage("Compressing %s in the background", buf->filename);
+}
+
+int streamReap(void) {
+    int reaped = 0;
+    for (int i = 0; i < E.numbuffers; i++) {
+        editorBuffer *buf = E.buffers[i];
+        int status;
+        if (buf->savepid <= 0 || waitpid(buf->savepid, &status, WNOHANG) != buf->savepid) continue;
+
+        buf->savepid = 0;
+        reaped++;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            // edits made while compressing still need saving
+            if (buf->dirty == buf->saveDirty) {
+                buf->dirty = 0;
+                diffSetBase(buf);
+            }
+            editorSetStatusMessage("%s compressed and written to disk", buf->filename);
+        } else {
+            editorSetStatusMessage("Can't save %s! compression failed", buf->filename);
+        }
+    }
+
+    return reaped;
+}
+
+/* DIFF GUTTER */
+// Every row remembers the line of the file as saved that it matched in the
+// last diff. Edits only widen a span of dirty rows; before the next frame the
+// span is widened to the nearest matched rows around it, and only the rows in
+// between are diffed against the saved lines between those two matches. Their
+// unchanged head and tail are skipped with plain compares and the rest goes
+// through Myers' algorithm, so an edit costs time in proportion to the rows it
+// touched rather than to the file. Large spans are diffed on a worker thread.
+uint64_t diffHash(const char *s, ssize_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t)len;
+    ssize_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, s + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; i++) hash = (hash ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+
+    return hash ^ (hash >> 32);
+}
+
+void diffReserve(editorBuffer *buf, ssize_t rows) {
+    diffState *d = &buf->diff;
+    if (rows <= d->cap) return;
+
+    d->cap = d->cap ? d->cap * 2 : 64;
+    if (d->cap < rows) d->cap = rows;
+    d->origin = memRealloc(MEM_DIFF, d->origin, sizeof(ssize_t) * d->cap);
+    d->marks = memRealloc(MEM_DIFF, d->marks, d->cap);
+    if (d->origin == NULL || d->marks == NULL) die("realloc");
+}
+
+void diffTouch(diffState *d, ssize_t lo, ssize_t hi) {
+    if (d->dirty) {
+        if (lo > d->lo) lo = d->lo;
+        if (hi < d->hi) hi = d->hi;
+    }
+    d->lo = lo;
+    d->hi = hi;
+    d->dirty = 1;
+}
+
+// Called before numrows changes. Rows inserted inside the window the worker
+// is diffing make its result useless, anywhere else they just shift it.
+void diffRowsInserted(editorBuffer *buf, ssize_t pos, ssize_t n) {
+    diffState *d = &buf->diff;
+    if (d->base == NULL) return;
+
+    diffReserve(buf, buf->numrows + n);
+    memmove(&d->origin[pos + n], &d->origin[pos], sizeof(ssize_t) * (buf->numrows - pos));
+    memmove(&d->marks[pos + n], &d->marks[pos], buf->numrows - pos);
+    for (ssize_t i = pos; i < pos + n; i++) {
+        d->origin[i] = -1;
+        d->marks[i] = DIFF_ADDED;
+    }
+
+    if (d->running) {
+        if (pos <= d->winlo) {
+            d->winlo += n;
+            d->winhi += n;
+        } else if (pos < d->winhi) {
+            d->stale = 1;
+            d->winhi += n;
+        }
+    }
+    if (d->loading) return;
+    if (d->dirty && d->hi > pos) d->hi += n;
+    diffTouch(d, pos, pos + n);
+}
+
+void diffRowsDeleted(editorBuffer *buf, ssize_t pos, ssize_t n) {
+    diffState *d = &buf->diff;
+    if (d->base == NULL) return;
+
+    memmove(&d->origin[pos], &d->origin[pos + n], sizeof(ssize_t) * (buf->numrows - pos - n));
+    memmove(&d->marks[pos], &d->marks[pos + n], buf->numrows - pos - n);
+
+    if (d->running && pos < d->winhi) {
+        if (pos + n <= d->winlo) {
+            d->winlo -= n;
+            d->winhi -= n;
+        } else {
+            d->stale = 1;
+            d->winlo = d->winlo < pos ? d->winlo : pos;
+            d->winhi = d->winhi > pos + n ? d->winhi - n : pos;
+        }
+    }
+    if (d->dirty) {
+        d->lo = d->lo <= pos ? d->lo : (d->lo >= pos + n ? d->lo - n : pos);
+        d->hi = d->hi <= pos ? d->hi : (d->hi >= pos + n ? d->hi - n : pos);
+    }
+    diffTouch(d, pos, pos);
+}
+
+void diffRowUpdated(editorBuffer *buf, editorRow *row) {
+    diffState *d = &buf->diff;
+    if (d->base && !d->loading) diffTouch(d, row->idx, row->idx + 1);
+}
+
+// Puts what the worker found into the rows it diffed, or leaves them dirty
+// when rows were inserted or deleted among them in the meantime.
+void diffJoin(editorBuffer *buf) {
+    diffState *d = &buf->diff;
+    if (!d->running) return;
+
+    pthread_join(d->thread, NULL);
+    char c;
+    while (read(d->wakefd[0], &c, 1) == 1);
+    d->running = 0;
+
+    if (d->stale) {
+        diffTouch(d, d->winlo, d->winhi);
+        return;
+    }
+
+    ssize_t n = d->numcur;
+    for (ssize_t i = 0; i < n; i++)
+        d->origin[d->winlo + i] = d->curorigin[i] < 0 ? -1 : d->winbase + d->curorigin[i];
+    memcpy(&d->marks[d->winlo], d->result, n);
+
+    // lines deleted after the window are marked on the row after it, or past
+    // the end on the last row, which the row before the window may no longer be
+    int deleted = d->result[n] & DIFF_DELETED;
+    if (d->winlo > 0) d->marks[d->winlo - 1] &= ~DIFF_DELETED_BELOW;
+    if (d->winhi < buf->numrows) d->marks[d->winhi] = (d->marks[d->winhi] & ~DIFF_DELETED) | deleted;
+    else if (buf->numrows > 0 && deleted) d->marks[buf->numrows - 1] |= DIFF_DELETED_BELOW;
+}
+
+void diffReset(editorBuffer *buf) {
+    diffState *d = &buf->diff;
+    diffJoin(buf);
+    memFree(MEM_DIFF, d->base);
+    memFree(MEM_DIFF, d->origin);
+    memFree(MEM_DIFF, d->marks);
+    d->base = NULL;
+    d->origin = NULL;
+    d->marks = NULL;
+    d->numbase = 0;
+    d->basecap = 0;
+    d->cap = 0;
+    d->dirty = 0;
+}
+
+void diffSetBase(editorBuffer *buf) {
+    diffReset(buf);
+    diffAppendBase(buf, 0);
+}
+
+// Rows from..numrows were just read from the file, which ends with them, so
+// they become the last saved lines and match themselves.
+void diffAppendBase(editorBuffer *buf, ssize_t from) {
+    diffState *d = &buf->diff;
+    if (from > 0 && d->base == NULL) return;
+
+    diffJoin(buf);
+    ssize_t n = buf->numrows - from;
+    if (d->numbase + n + 1 > d->basecap) {
+        d->basecap = d->numbase + n + 1 > d->basecap * 2 ? d->numbase + n + 1 : d->basecap * 2;
+        d->base = memRealloc(MEM_DIFF, d->base, sizeof(uint64_t) * d->basecap);
+        if (d->base == NULL) die("realloc");
+    }
+    diffReserve(buf, buf->numrows);
+    for (ssize_t i = 0; i < n; i++) {
+        editorRow *row = &buf->row[from + i];
+        d->base[d->numbase + i] = diffHash(row->chars, row->size);
+        d->origin[from + i] = d->numbase + i;
+        d->marks[from + i] = DIFF_NONE;
+    }
+    d->numbase += n;
+    // the last row before them is no longer the last
+    if (n > 0 && from > 0) d->marks[from - 1] &= ~DIFF_DELETED_BELOW;
+}
+
+// Marks a span where `deleted` saved lines became `inserted` rows at row `at`:
+// rows that replace a line are modified, the rest are added, and lines deleted
+// beyond the inserted rows are marked on the row after them, which is the
+// extra mark past the last row at the end.
+void diffMarkSpan(unsigned char *marks, ssize_t at, ssize_t deleted, ssize_t inserted) {
+    for (ssize_t i = 0; i < inserted; i++)
+        marks[at + i] = i < deleted ? DIFF_MODIFIED : DIFF_ADDED;
+    if (deleted > inserted) marks[at + inserted] |= DIFF_DELETED;
+}
+
+// Myers' O(ND) diff keeping every round's furthest reaching paths, so the
+// edit script can be walked back. Gives up past DIFF_MAX_EDITS edits. Rows of
+// b that match a line of a get its index plus aoff in origin.
+int diffMyers(const uint64_t *a, ssize_t n, const uint64_t *b, ssize_t m, unsigned char *marks, ssize_t *origin, ssize_t aoff) {
+    ssize_t max = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+    ssize_t width = 2 * max + 3;
+    ssize_t off = max + 1;
+    ssize_t *trace = memMalloc(MEM_DIFF, sizeof(ssize_t) * width * (max + 1));
+    if (trace == NULL) return -1;
+
+    ssize_t *v = trace;
+    ssize_t edits = -1;
+    v[off + 1] = 0;
+    for (ssize_t d = 0; d <= max && edits == -1; d++) {
+        if (d > 0) {
+            memcpy(trace + d * width, trace + (d - 1) * width, sizeof(ssize_t) * width);
+            v = trace + d * width;
+        }
+        for (ssize_t k = -d; k <= d; k += 2) {
+            ssize_t x = (k == -d || (k != d && v[off + k - 1] < v[off + k + 1])) ? v[off + k + 1] : v[off + k - 1] + 1;
+            ssize_t y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            v[off + k] = x;
+            if (x >= n && y >= m) {
+                edits = d;
+                break;
+            }
+        }
+    }
+    if (edits == -1) {
+        memFree(MEM_DIFF, trace);
+        return -1;
+    }
+
+    // walk back, collecting runs of deletions and insertions between snakes
+    ssize_t x = n;
+    ssize_t y = m;
+    ssize_t deleted = 0;
+    ssize_t inserted = 0;
+    for (ssize_t d = edits; d > 0; d--) {
+        ssize_t *prev = trace + (d - 1) * width;
+        ssize_t k = x - y;
+        ssize_t pk = (k == -d || (k != d && prev[off + k - 1] < prev[off + k + 1])) ? k + 1 : k - 1;
+        ssize_t px = prev[off + pk];
+        ssize_t py = px - pk;
+
+        if (x > px && y > py && (deleted || inserted)) {
+            diffMarkSpan(marks, y, deleted, inserted);
+            deleted = inserted = 0;
+        }
+        while (x > px && y > py) {
+            x--;
+            y--;
+            origin[y] = aoff + x;
+        }
+        if (pk == k + 1) inserted++;
+        else deleted++;
+        x = px;
+        y = py;
+    }
+    if (deleted || inserted) diffMarkSpan(marks, y, deleted, inserted);
+    while (x > 0 && y > 0) {
+        x--;
+        y--;
+        origin[y] = aoff + x;
+    }
+
+    memFree(MEM_DIFF, trace);
+    return 0;
+}
+
+// Fills in m + 1 marks and m origins for rows b against lines a.
+void diffCompute(const uint64_t *a, ssize_t n, const uint64_t *b, ssize_t m, unsigned char *marks, ssize_t *origin) {
+    memset(marks, DIFF_NONE, m + 1);
+    for (ssize_t i = 0; i < m; i++) origin[i] = -1;
+
+    ssize_t head = 0;
+    while (head < n && head < m && a[head] == b[head]) {
+        origin[head] = head;
+        head++;
+    }
+    ssize_t tail = 0;
+    while (tail < n - head && tail < m - head && a[n - 1 - tail] == b[m - 1 - tail]) {
+        origin[m - 1 - tail] = n - 1 - tail;
+        tail++;
+    }
+
+    n -= head + tail;
+    m -= head + tail;
+    if (n == 0 && m == 0) return;
+    if (diffMyers(a + head, n, b + head, m, marks + head, origin + head, head) == 0) return;
+
+    // too many edits to line up, compare the span row by row instead
+    for (ssize_t i = 0; i < n && i < m; i++) {
+        if (a[head + i] == b[head + i]) origin[head + i] = head + i;
+        else marks[head + i] = DIFF_MODIFIED;
+    }
+    if (n != m) diffMarkSpan(marks, head + (n < m ? n : m), n > m ? n - m : 0, m > n ? m - n : 0);
+}
+
+void *diffWorker(void *arg) {
+    editorBuffer *buf = arg;
+    diffState *d = &buf->diff;
+    diffCompute(&d->base[d->winbase], d->numwinbase, d->cur, d->numcur, d->result, d->curorigin);
+    write(d->wakefd[1], "", 1);
+
+    return NULL;
+}
+
+// Called before each frame: picks up a finished diff and starts the next one
+// if rows changed since. Only one diff per buffer runs at a time.
+void diffUpdate(editorBuffer *buf) {
+    diffState *d = &buf->diff;
+    char c;
+    if (d->running && read(d->wakefd[0], &c, 1) == 1) diffJoin(buf);
+    if (d->base == NULL || d->running || !d->dirty) return;
+
+    // widen the dirty rows to the matched rows around them, which bound the saved lines
+    ssize_t hi = d->hi < buf->numrows ? d->hi : buf->numrows;
+    ssize_t lo = d->lo < hi ? d->lo : hi;
+    while (lo > 0 && d->origin[lo - 1] < 0) lo--;
+    while (hi < buf->numrows && d->origin[hi] < 0) hi++;
+    d->dirty = 0;
+    d->stale = 0;
+    d->winlo = lo;
+    d->winhi = hi;
+    d->winbase = lo > 0 ? d->origin[lo - 1] + 1 : 0;
+    d->numwinbase = (hi < buf->numrows ? d->origin[hi] : d->numbase) - d->winbase;
+
+    ssize_t n = hi - lo;
+    d->numcur = n;
+    if (n + 1 > d->curcap) {
+        d->curcap = n + 1;
+        d->cur = memRealloc(MEM_DIFF, d->cur, sizeof(uint64_t) * d->curcap);
+        d->curorigin = memRealloc(MEM_DIFF, d->curorigin, sizeof(ssize_t) * d->curcap);
+        d->result = memRealloc(MEM_DIFF, d->result, d->curcap);
+        if (d->cur == NULL || d->curorigin == NULL || d->result == NULL) die("realloc");
+    }
+    for (ssize_t i = 0; i < n; i++) d->cur[i] = diffHash(buf->row[lo + i].chars, buf->row[lo + i].size);
+
+    if (n + d->numwinbase > DIFF_INLINE_ROWS && pthread_create(&d->thread, NULL, diffWorker, buf) == 0) d->running = 1;
+    else {
+        diffWorker(buf);
+        d->running = 1;
+        diffJoin(buf);
+    }
+}
+
+void diffDrawGutter(editorBuffer *buf, editorRow *row, appendBuffer *ab) {
+    diffState *d = &buf->diff;
+    int mark = d->marks && row->idx < buf->numrows ? d->marks[row->idx] : DIFF_NONE;
+    // a changed row shows the change, any other row that lines were deleted around shows that
+    if (mark & DIFF_KIND) mark &= DIFF_KIND;
+    else if (mark) mark = DIFF_DELETED;
+
+    switch (mark) {
+        case DIFF_ADDED:
+            abAppend(ab, "\x1b[32m+\x1b[39m", 11);
+            break;
+        case DIFF_MODIFIED:
+            abAppend(ab, "\x1b[33m~\x1b[39m", 11);
+            break;
+        case DIFF_DELETED:
+            abAppend(ab, "\x1b[31m-\x1b[39m", 11);
+            break;
+        default:
+            abAppend(ab, " ", KILO_GUTTER);
+    }
+}
+
+/* BACKGROUND WORK */
+int backgroundBusy(void) {
+    if (E.grep) return 1;
+    for (int i = 0; i < E.numbuffers; i++) {
+        editorBuffer *buf = E.buffers[i];
+        if (buf->streamfd != -1 || buf->savepid > 0 || buf->diff.running) return 1;
+    }
+
+    return 0;
+}
+
+// Runs everything the editor does in the background until a key is ready:
+// feeds decompressed rows into their buffers, picks up finished diffs and
+// search results and reaps compressed saves, redrawing when any of them
+// changed something.
+void backgroundWait(void) {
+    while (backgroundBusy()) {
+        struct pollfd fds[2 + 2 * E.numbuffers];
+        editorBuffer *owners[2 + 2 * E.numbuffers];
+        int nfds = 0;
+        fds[nfds].fd = E.infd;
+        fds[nfds++].events = POLLIN;
+        if (E.grep) {
+            owners[nfds] = NULL;
+            fds[nfds].fd = E.grep->wakefd[0];
+            fds[nfds++].events = POLLIN;
+        }
+        for (int i = 0; i < E.numbuffers; i++) {
+            editorBuffer *buf = E.buffers[i];
+            if (buf->streamfd != -1) {
+                owners[nfds] = buf;
+                fds[nfds].fd = buf->streamfd;
+                fds[nfds++].events = POLLIN;
+            }
+            if (buf->diff.running) {
+                owners[nfds] = buf;
+                fds[nfds].fd = buf->diff.wakefd[0];
+                fds[nfds++].events = POLLIN;
+            }
+        }
+
+        if (poll(fds, nfds, STREAM_POLL_MS) == -1 && errno != EINTR) die("poll");
+
+        int redraw = 0;
+        for (int i = 1; i < nfds; i++) {
+            if (!fds[i].revents) continue;
+            if (owners[i] == NULL) {
+                if (E.grep && grepDrain()) redraw = 1;
+            } else if (fds[i].fd == owners[i]->diff.wakefd[0]) redraw = 1;
+            else if (streamRead(owners[i]) != 0) redraw = 1;
+        }
+        if (streamReap()) redraw = 1;
+
+        if (redraw) editorRefreshScreen();
+        if (fds[0].revents) return;
+    }
+}
+
+/* FILE I/O */
+size_t editorRowsLength(editorBuffer *buf) {
+    size_t len = 0;
+    for (ssize_t i = 0; i < buf->numrows; i++)
+        len += buf->row[i].size + 1;
+
+    return len;
+}
+
+// write() transfers at most ~2 GB per call, so keep going until done.
+int editorWriteAll(int fd, const char *s, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, s, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Writes the rows through a SAVE_CHUNK buffer, so saving a file of many GB
+// needs no copy of it. Rows that don't fit in the buffer are written directly.
+int editorWriteRows(editorBuffer *buf, int fd, char *chunk) {
+    size_t used = 0;
+    for (ssize_t i = 0; i < buf->numrows; i++) {
+        editorRow *row = &buf->row[i];
+        if (used + row->size + 1 > SAVE_CHUNK) {
+            if (editorWriteAll(fd, chunk, used) == -1) return -1;
+            used = 0;
+        }
+        if (row->size + 1 > SAVE_CHUNK) {
+            if (editorWriteAll(fd, row->chars, row->size) == -1 || editorWriteAll(fd, "\n", 1) == -1) return -1;
+            continue;
+        }
+        memcpy(&chunk[used], row->chars, row->size);
+        used += row->size;
+        chunk[used++] = '\n';
+    }
+
+    return editorWriteAll(fd, chunk, used);
+}
+
+void editorOpen(editorBuffer *buf, char *filename) {
+    streamClose(buf);
+    diffReset(buf);
+    free(buf->filename);
+    buf->filename = strdup(filename);
+    editorFreeRows(buf);
+
+    editorSelectSyntaxHighlight(buf);
+
+    editorCompressor *c = compressorForFile(filename);
+    if (c) {
+        streamOpen(buf, c);
+        buf->dirty = 0;
+        diffSetBase(buf);
+        return;
+    }
+
+    if (cacheLoad(buf, filename)) {
+        buf->dirty = 0;
+        diffSetBase(buf);
+        return;
+    }
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+
+    uint64_t *offsets = NULL;
+    ssize_t offcap = 0;
+    uint64_t offset = 0;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    buf->store.exact = 1;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        if (buf->numrows + 1 >= offcap) {
+            offcap = offcap ? offcap * 2 : 1024;
+            offsets = memRealloc(MEM_TEXT, offsets, sizeof(uint64_t) * offcap);
+            if (offsets == NULL) die("realloc");
+        }
+        offsets[buf->numrows] = offset;
+        offset += linelen;
+
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+        editorInsertRow(buf, buf->numrows, line, linelen);
+    }
+    buf->store.exact = 0;
+    // getline grows the line buffer itself, so it's counted once it is done
+    if (line) memCount(MEM_TEXT, malloc_usable_size(line));
+    memFree(MEM_TEXT, line);
+    fclose(fp);
+    buf->dirty = 0;
+    diffSetBase(buf);
+
+    if (offsets) {
+        offsets[buf->numrows] = offset;
+        cacheStore(buf, filename, offsets);
+        memFree(MEM_TEXT, offsets);
+    }
+}
+
+void editorOpenPrompt(void) {
+    char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+    if (filename == NULL) {
+        editorSetStatusMessage("Open aborted");
+        return;
+    }
+
+    wordexp_t expanded;
+    wordexp(filename, &expanded, 0);
+    free(filename);
+    char *path = expanded.we_wordv[0];
+
+    editorBuffer *buf = editorFindBuffer(path);
+    if (buf == NULL) {
+        if (access(path, R_OK) == -1) {
+            editorSetStatusMessage("Can't open %s: %s", path, strerror(errno));
+            return;
+        }
+        buf = editorNewBuffer();
+        editorOpen(buf, path);
+    }
+    editorShowBuffer(E.view, buf);
+}
+
+void editorSave(editorBuffer *buf) {
+    if (buf->filename == NULL){
+        char *filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
         wordexp_t expanded;
         wordexp(filename, &expanded, 0);
-        E.filename = expanded.we_wordv[0];
+        buf->filename = expanded.we_wordv[0];
         
-        if (E.filename == NULL) {
+        if (buf->filename == NULL) {
             editorSetStatusMessage("Save aborted");
             return;
         }
-        editorSelectSyntaxHighlight();
+        editorSelectSyntaxHighlight(buf);
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+    editorCompressor *c = compressorForName(buf->filename);
+    if (c) {
+        streamSave(buf, c);
+        return;
+    }
+
+    char *chunk = memMalloc(MEM_TEXT, SAVE_CHUNK);
+    if (chunk == NULL) {
+        editorSetStatusMessage("Can't save! Out of memory");
+        return;
+    }
+    size_t len = editorRowsLength(buf);
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+    int fd = open(buf->filename, O_RDWR | O_CREAT, 0644);
     if (fd != -1) {
         if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
+            if (editorWriteRows(buf, fd, chunk) == 0) {
                 close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
+                memFree(MEM_TEXT, chunk);
+                buf->dirty = 0;
+                cacheStore(buf, buf->filename, NULL);
+                diffSetBase(buf);
+                editorSetStatusMessage("%zu bytes written to disk", len);
                 return;
             }
         }
         close(fd);
     }
-    free(buf);
+    memFree(MEM_TEXT, chunk);
     editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-    E.filename = NULL;
+    buf->filename = NULL;
 }
 
 /* FIND */
 void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
+    static ssize_t last_match = -1;
     static int direction = 1;
 
-    static int saved_hl_line;
+    static ssize_t saved_hl_line;
     static char *saved_hl = NULL;
 
+    editorView *v = E.view;
+    editorBuffer *buf = v->buf;
+
     if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
+        memcpy(buf->row[saved_hl_line].hl, saved_hl, buf->row[saved_hl_line].rsize);
+        memFree(MEM_SEARCH, saved_hl);
         saved_hl = NULL;
     }
 
@@ -708,22 +4109,24 @@ void editorFindCallback(char *query, int key) {
     }
 
     if (last_match == -1) direction = 1;
-    int current = last_match;
-    for (int i = 0; i < E.numrows; i++) {
+    ssize_t current = last_match;
+    for (ssize_t i = 0; i < buf->numrows; i++) {
         current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
+        if (current == -1) current = buf->numrows - 1;
+        else if (current == buf->numrows) current = 0;
 
-        editorRow *row = &E.row[current];
+        editorRow *row = &buf->row[current];
         char *match = strstr(row->render, query);
         if (match) {
             last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
+            // on a filtered view the match's row is shown while the cursor is there
+            v->cy = current;
+            v->cx = editorRowRxToCx(row, editorRowRenderToRx(row, match - row->render));
+            v->rowoff = buf->numrows;
 
+            if (row->hlStale) editorHighlightRow(buf, row);
             saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
+            saved_hl = memMalloc(MEM_SEARCH, row->rsize);
             memcpy(saved_hl, row->hl, row->rsize);
             memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
             break;
@@ -732,42 +4135,627 @@ void editorFindCallback(char *query, int key) {
 }
 
 void editorFind(void) {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+    editorView *v = E.view;
+    ssize_t saved_cx = v->cx;
+    ssize_t saved_cy = v->cy;
+    ssize_t saved_coloff = v->coloff;
+    ssize_t saved_rowoff = v->rowoff;
 
     char *query = editorPrompt("Search: %s (ESC = cancel | Arrows = move to other results | ENTER = confirm)", editorFindCallback);
     
     if (query) free(query);
     else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        v->cx = saved_cx;
+        v->cy = saved_cy;
+        v->coloff = saved_coloff;
+        v->rowoff = saved_rowoff;
+    }
+}
+
+/* FILTER */
+// A filtered view shows only the rows containing a query. It keeps a sorted
+// array of the matching row numbers and maps its lines through it, so no row is
+// copied. The row operations report every change here to keep the array current.
+ssize_t filterLines(editorView *v) {
+    return v->filter.query ? v->filter.numrows : v->buf->numrows;
+}
+
+// Lines past the last match map to the empty line after the buffer.
+ssize_t filterRow(editorView *v, ssize_t line) {
+    if (v->filter.query == NULL) return line;
+    return line < v->filter.numrows ? v->filter.rows[line] : v->buf->numrows;
+}
+
+// The first line showing row cy or a row after it.
+ssize_t filterLine(editorView *v, ssize_t cy) {
+    if (v->filter.query == NULL) return cy;
+
+    ssize_t lo = 0;
+    ssize_t hi = v->filter.numrows;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (v->filter.rows[mid] < cy) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+// Rows are short, so finding the first byte with memchr and comparing the rest
+// beats setting up memmem on every row.
+int filterMatch(lineFilter *f, editorRow *row) {
+    if ((size_t)row->size < f->querylen) return 0;
+
+    char *p = row->chars;
+    char *last = row->chars + row->size - f->querylen;
+    while (p <= last && (p = memchr(p, f->query[0], last - p + 1)) != NULL) {
+        if (!memcmp(p + 1, f->query + 1, f->querylen - 1)) return 1;
+        p++;
+    }
+
+    return 0;
+}
+
+void filterInsert(lineFilter *f, ssize_t line, ssize_t row) {
+    if (f->numrows == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 1024;
+        f->rows = memRealloc(MEM_SEARCH, f->rows, sizeof(ssize_t) * f->cap);
+        if (f->rows == NULL) die("realloc");
+    }
+    memmove(&f->rows[line + 1], &f->rows[line], sizeof(ssize_t) * (f->numrows - line));
+    f->rows[line] = row;
+    f->numrows++;
+}
+
+void filterRemove(lineFilter *f, ssize_t line) {
+    memmove(&f->rows[line], &f->rows[line + 1], sizeof(ssize_t) * (f->numrows - line - 1));
+    f->numrows--;
+}
+
+// Takes ownership of query, NULL or an empty query shows every row again.
+void filterSet(editorView *v, char *query) {
+    lineFilter *f = &v->filter;
+    free(f->query);
+    memFree(MEM_SEARCH, f->rows);
+    memset(f, 0, sizeof(lineFilter));
+
+    if (query == NULL || query[0] == '\0') {
+        free(query);
+        return;
+    }
+
+    f->query = query;
+    f->querylen = strlen(query);
+    f->kept = -1;
+    filterScan(v);
+}
+
+void filterScan(editorView *v) {
+    lineFilter *f = &v->filter;
+    f->numrows = 0;
+    f->kept = -1;
+    for (ssize_t i = 0; i < v->buf->numrows; i++)
+        if (filterMatch(f, &v->buf->row[i])) filterInsert(f, f->numrows, i);
+}
+
+// Bulk line operations move many rows at once, so rescan instead of patching.
+void filterRefresh(editorBuffer *buf) {
+    for (int i = 0; i < E.numviews; i++)
+        if (E.views[i].buf == buf && E.views[i].filter.query) filterScan(&E.views[i]);
+}
+
+void filterRowsInserted(editorBuffer *buf, ssize_t pos, ssize_t n) {
+    for (int i = 0; i < E.numviews; i++) {
+        editorView *v = &E.views[i];
+        if (v->buf != buf || v->filter.query == NULL) continue;
+
+        for (ssize_t line = filterLine(v, pos); line < v->filter.numrows; line++)
+            v->filter.rows[line] += n;
+        if (v->filter.kept >= pos) v->filter.kept += n;
+    }
+}
+
+void filterRowsDeleted(editorBuffer *buf, ssize_t pos, ssize_t n) {
+    for (int i = 0; i < E.numviews; i++) {
+        editorView *v = &E.views[i];
+        lineFilter *f = &v->filter;
+        if (v->buf != buf || f->query == NULL) continue;
+
+        ssize_t line = filterLine(v, pos);
+        ssize_t end = filterLine(v, pos + n);
+        memmove(&f->rows[line], &f->rows[end], sizeof(ssize_t) * (f->numrows - end));
+        f->numrows -= end - line;
+        for (; line < f->numrows; line++) f->rows[line] -= n;
+        if (f->kept >= pos + n) f->kept -= n;
+        else if (f->kept >= pos) f->kept = -1;
+    }
+}
+
+void filterRowUpdated(editorBuffer *buf, editorRow *row) {
+    for (int i = 0; i < E.numviews; i++) {
+        editorView *v = &E.views[i];
+        if (v->buf != buf || v->filter.query == NULL) continue;
+
+        ssize_t line = filterLine(v, row->idx);
+        int listed = line < v->filter.numrows && v->filter.rows[line] == row->idx;
+        int match = filterMatch(&v->filter, row);
+        if (match && !listed) filterInsert(&v->filter, line, row->idx);
+        else if (!match && listed) filterRemove(&v->filter, line);
+    }
+}
+
+void filterRowsFreed(editorBuffer *buf) {
+    for (int i = 0; i < E.numviews; i++) {
+        if (E.views[i].buf != buf) continue;
+        E.views[i].filter.numrows = 0;
+        E.views[i].filter.kept = -1;
+    }
+}
+
+// The cursor's row stays on screen while the cursor is on it, even after an
+// edit or a search lands it on a row that doesn't match, and goes once the
+// cursor leaves it.
+void filterFollow(editorView *v) {
+    lineFilter *f = &v->filter;
+    if (f->query == NULL) return;
+
+    if (f->kept >= 0 && f->kept != v->cy) {
+        ssize_t line = filterLine(v, f->kept);
+        if (line < f->numrows && f->rows[line] == f->kept && !filterMatch(f, &v->buf->row[f->kept]))
+            filterRemove(f, line);
+        f->kept = -1;
+    }
+    if (v->cy < v->buf->numrows) {
+        ssize_t line = filterLine(v, v->cy);
+        if (line == f->numrows || f->rows[line] != v->cy) {
+            filterInsert(f, line, v->cy);
+            f->kept = v->cy;
+        }
+    }
+}
+
+void editorFilter(void) {
+    editorView *v = E.view;
+    char *query = editorPrompt("Filter: %s (ESC or empty = show all rows)", NULL);
+
+    filterSet(v, query);
+    v->cy = filterRow(v, filterLine(v, v->cy));
+    v->cx = 0;
+}
+
+/* PROJECT SEARCH */
+// Ctrl-G searches every file under the current directory. One thread walks the
+// tree and queues the files, a pool of workers mmaps and scans them, and each
+// worker hands over the hits of a whole file at a time, which the UI appends
+// to a results buffer while the search goes on.
+
+// Finds needle in s. With SSE2, 16 positions at a time are checked for the
+// needle's first and last byte, and only those are compared in full.
+const char *grepFind(const char *s, size_t len, const char *needle, size_t n) {
+    if (n > len) return NULL;
+
+    size_t i = 0;
+#ifdef __SSE2__
+    if (n > 1) {
+        __m128i first = _mm_set1_epi8(needle[0]);
+        __m128i last = _mm_set1_epi8(needle[n - 1]);
+        for (; i + n - 1 + 16 <= len; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+            __m128i b = _mm_loadu_si128((const __m128i *)&s[i + n - 1]);
+            unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+            while (mask) {
+                int bit = __builtin_ctz(mask);
+                if (!memcmp(&s[i + bit + 1], needle + 1, n - 2)) return &s[i + bit];
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    return memmem(&s[i], len - i, needle, n);
+}
+
+size_t grepCountLines(const char *s, size_t len) {
+    size_t i = 0;
+    size_t count = 0;
+
+#ifdef __SSE2__
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)&s[i]);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl)));
+    }
+#endif
+
+    for (; i < len; i++) count += s[i] == '\n';
+    return count;
+}
+
+// Appends a "path:line:text" result for every line of s with a match and
+// returns how many there were.
+unsigned long long grepScan(grepSearch *g, regex_t *re, const char *path, const char *s, size_t len, appendBuffer *out) {
+    const char *p = s;
+    const char *end = s + len;
+    const char *counted = s;
+    size_t line = 1;
+    unsigned long long hits = 0;
+
+    while (p < end) {
+        const char *match;
+        if (re) {
+            regmatch_t m = { 0, end - p };
+            match = regexec(re, p, 1, &m, REG_STARTEND) == 0 ? p + m.rm_so : NULL;
+        } else {
+            match = grepFind(p, end - p, g->query, g->querylen);
+        }
+        // an empty match after the final newline is not on a line
+        if (match == NULL || (match == end && end[-1] == '\n')) break;
+
+        // p is always at the start of a line
+        const char *start = memrchr(p, '\n', match - p);
+        start = start ? start + 1 : p;
+        const char *eol = memchr(match, '\n', end - match);
+        if (eol == NULL) eol = end;
+        line += grepCountLines(counted, start - counted);
+        counted = start;
+
+        size_t n = eol - start;
+        while (n > 0 && start[n - 1] == '\r') n--;
+        if (n > GREP_MAX_LINE) n = GREP_MAX_LINE;
+        // appended piece by piece, since a deep walk can build paths past PATH_MAX
+        char num[32];
+        int numlen = snprintf(num, sizeof(num), ":%zu:", line);
+        abAppend(out, path, strlen(path));
+        abAppend(out, num, numlen);
+        abAppend(out, start, n);
+        abAppend(out, "\n", 1);
+        hits++;
+        p = eol + 1;
+    }
+
+    return hits;
+}
+
+void grepFile(grepSearch *g, regex_t *re, char *path, appendBuffer *out) {
+    unsigned long long hits = 0;
+    size_t bytes = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        bytes = st.st_size;
+        char *data = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, bytes, MADV_SEQUENTIAL);
+            // like grep, a NUL byte near the start means a binary file
+            if (memchr(data, '\0', bytes < 4096 ? bytes : 4096) == NULL)
+                hits = grepScan(g, re, path, data, bytes, out);
+            munmap(data, bytes);
+        }
+    }
+    if (fd != -1) close(fd);
+    free(path);
+
+    pthread_mutex_lock(&g->lock);
+    if (out->len) abAppend(&g->hits, out->buf, out->len);
+    g->numhits += hits;
+    g->scanned++;
+    g->bytes += bytes;
+    if (g->numhits >= GREP_MAX_HITS) {
+        g->stop = 1;
+        pthread_cond_broadcast(&g->ready);
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    if (out->len) write(g->wakefd[1], "", 1);
+    out->len = 0;
+}
+
+// Hands a path to the workers. Returns 0 once the search is stopping.
+int grepQueue(grepSearch *g, char *path) {
+    pthread_mutex_lock(&g->lock);
+    if (g->numfiles == g->filecap) {
+        g->filecap = g->filecap ? g->filecap * 2 : 1024;
+        g->files = memRealloc(MEM_SEARCH, g->files, sizeof(char *) * g->filecap);
+        if (g->files == NULL) die("realloc");
+    }
+    g->files[g->numfiles++] = path;
+    int stop = g->stop;
+    pthread_cond_signal(&g->ready);
+    pthread_mutex_unlock(&g->lock);
+
+    return !stop;
+}
+
+// Walks the tree depth first without following symlinks, skipping hidden
+// files and directories like .git.
+void *grepWalker(void *arg) {
+    grepSearch *g = arg;
+    char **dirs = memMalloc(MEM_SEARCH, sizeof(char *));
+    if (dirs == NULL) die("malloc");
+    ssize_t numdirs = 0;
+    ssize_t dircap = 1;
+    dirs[numdirs++] = strdup(".");
+
+    int going = 1;
+    while (numdirs > 0) {
+        char *dir = dirs[--numdirs];
+        DIR *dp = going ? opendir(dir) : NULL;
+        struct dirent *de;
+        while (dp && going && (de = readdir(dp)) != NULL) {
+            if (de->d_name[0] == '.') continue;
+
+            char *path;
+            if (!strcmp(dir, ".")) path = strdup(de->d_name);
+            else if (asprintf(&path, "%s/%s", dir, de->d_name) == -1) path = NULL;
+            if (path == NULL) die("malloc");
+
+            int type = de->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+
+            if (type == DT_REG) {
+                going = grepQueue(g, path);
+            } else if (type == DT_DIR) {
+                if (numdirs == dircap) {
+                    dircap *= 2;
+                    dirs = memRealloc(MEM_SEARCH, dirs, sizeof(char *) * dircap);
+                    if (dirs == NULL) die("realloc");
+                }
+                dirs[numdirs++] = path;
+            } else {
+                free(path);
+            }
+        }
+        if (dp) closedir(dp);
+        free(dir);
+    }
+    memFree(MEM_SEARCH, dirs);
+
+    pthread_mutex_lock(&g->lock);
+    g->walking = 0;
+    pthread_cond_broadcast(&g->ready);
+    pthread_mutex_unlock(&g->lock);
+
+    return NULL;
+}
+
+void *grepWorker(void *arg) {
+    grepSearch *g = arg;
+    appendBuffer out = { NULL, 0, 0, MEM_SEARCH };
+    // glibc serialises regexec calls on one regex_t, so every worker compiles its own
+    regex_t re;
+    int regex = g->regex && regcomp(&re, g->query, REG_EXTENDED | REG_NEWLINE) == 0;
+
+    pthread_mutex_lock(&g->lock);
+    while (!g->stop) {
+        if (g->nextfile < g->numfiles) {
+            char *path = g->files[g->nextfile++];
+            pthread_mutex_unlock(&g->lock);
+            grepFile(g, regex ? &re : NULL, path, &out);
+            pthread_mutex_lock(&g->lock);
+        } else if (g->walking) {
+            pthread_cond_wait(&g->ready, &g->lock);
+        } else {
+            break;
+        }
+    }
+    // the last worker to leave tells the UI the search is over
+    write(g->wakefd[1], "", 1);
+    g->workers--;
+    pthread_mutex_unlock(&g->lock);
+
+    if (regex) regfree(&re);
+    abFree(&out);
+
+    return NULL;
+}
+
+// Stops a running search and waits for its threads.
+void grepStop(void) {
+    grepSearch *g = E.grep;
+    if (g == NULL) return;
+
+    pthread_mutex_lock(&g->lock);
+    g->stop = 1;
+    pthread_cond_broadcast(&g->ready);
+    pthread_mutex_unlock(&g->lock);
+    pthread_join(g->walker, NULL);
+    for (int i = 0; i < g->numthreads; i++) pthread_join(g->threads[i], NULL);
+
+    for (ssize_t i = g->nextfile; i < g->numfiles; i++) free(g->files[i]);
+    memFree(MEM_SEARCH, g->files);
+    free(g->query);
+    abFree(&g->hits);
+    close(g->wakefd[0]);
+    close(g->wakefd[1]);
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->ready);
+    memFree(MEM_SEARCH, g);
+    E.grep = NULL;
+}
+
+// Appends the hits the workers handed over since the last call and ends the
+// search once every worker is done. Returns whether anything changed.
+int grepDrain(void) {
+    grepSearch *g = E.grep;
+    char c;
+    while (read(g->wakefd[0], &c, 1) == 1);
+
+    pthread_mutex_lock(&g->lock);
+    appendBuffer hits = g->hits;
+    g->hits.buf = NULL;
+    g->hits.len = 0;
+    g->hits.cap = 0;
+    int done = g->workers == 0;
+    pthread_mutex_unlock(&g->lock);
+
+    // results are not edits
+    editorBuffer *buf = g->buf;
+    int dirty = buf->dirty;
+    char *start = hits.buf;
+    char *end = hits.buf + hits.len;
+    char *nl;
+    while (start < end && (nl = memchr(start, '\n', end - start)) != NULL) {
+        editorInsertRow(buf, buf->numrows, start, nl - start);
+        start = nl + 1;
+    }
+    buf->dirty = dirty;
+    int changed = hits.len > 0 || done;
+    abFree(&hits);
+
+    if (done) {
+        double secs = (perfNow() - g->start) / 1e9;
+        editorSetStatusMessage("%llu matches in %llu files, %.1f MB/s%s",
+                               g->numhits, g->scanned, g->bytes / (secs > 0 ? secs : 1e-9) / (1024 * 1024),
+                               g->numhits >= GREP_MAX_HITS ? " (stopped at the match limit)" : "");
+        grepStop();
+    }
+
+    return changed;
+}
+
+// Takes ownership of query and shows the results buffer in the current view.
+void grepStart(char *query) {
+    grepStop();
+    grepSearch *g = memCalloc(MEM_SEARCH, 1, sizeof(grepSearch));
+    if (g == NULL) die("calloc");
+    if (!strncmp(query, "-e ", 3)) {
+        g->regex = 1;
+        memmove(query, query + 3, strlen(query + 3) + 1);
+    }
+    g->query = query;
+    g->querylen = strlen(query);
+    g->hits.tag = MEM_SEARCH;
+
+    if (g->regex) {
+        regex_t re;
+        int err = regcomp(&re, query, REG_EXTENDED | REG_NEWLINE);
+        if (err) {
+            char msg[64];
+            regerror(err, &re, msg, sizeof(msg));
+            editorSetStatusMessage("Bad regex: %s", msg);
+            free(query);
+            memFree(MEM_SEARCH, g);
+            return;
+        }
+        regfree(&re);
+    }
+
+    // one results buffer, reused by every search
+    for (int i = 0; i < E.numbuffers && g->buf == NULL; i++)
+        if (E.buffers[i]->grep) g->buf = E.buffers[i];
+    if (g->buf == NULL) {
+        g->buf = editorNewBuffer();
+        g->buf->grep = 1;
+    }
+    editorFreeRows(g->buf);
+    g->buf->dirty = 0;
+    for (int i = 0; i < E.numviews; i++)
+        if (E.views[i].buf == g->buf) editorShowBuffer(&E.views[i], g->buf);
+    editorShowBuffer(E.view, g->buf);
+
+    if (pipe2(g->wakefd, O_CLOEXEC | O_NONBLOCK) == -1) die("pipe");
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->ready, NULL);
+    g->walking = 1;
+    g->start = perfNow();
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    g->numthreads = cores < 1 ? 1 : cores > GREP_MAX_THREADS ? GREP_MAX_THREADS : cores;
+    g->workers = g->numthreads;
+    if (pthread_create(&g->walker, NULL, grepWalker, g) != 0) die("pthread_create");
+    for (int i = 0; i < g->numthreads; i++)
+        if (pthread_create(&g->threads[i], NULL, grepWorker, g) != 0) die("pthread_create");
+    E.grep = g;
+    editorSetStatusMessage("Searching for \"%s\"...", query);
+}
+
+void editorGrep(void) {
+    char *query = editorPrompt("Grep: %s (-e REGEX for a regex | ESC to cancel)", NULL);
+    if (query == NULL || query[0] == '\0') {
+        free(query);
+        editorSetStatusMessage("Grep aborted");
+        return;
+    }
+
+    grepStart(query);
+}
+
+// Opens the file of the result under the cursor at the line it names.
+void editorGrepOpen(editorView *v) {
+    editorBuffer *buf = v->buf;
+    char *colon = NULL;
+    if (v->cy < buf->numrows) {
+        // the path runs up to the first ":N:", so paths with colons still work
+        char *s = buf->row[v->cy].chars;
+        for (char *p = s; (p = strchr(p, ':')) != NULL; p++) {
+            size_t digits = strspn(p + 1, "0123456789");
+            if (digits > 0 && p[1 + digits] == ':') {
+                colon = p;
+                break;
+            }
+        }
+    }
+    if (colon == NULL) {
+        editorSetStatusMessage("Not a search result");
+        return;
     }
+
+    char *path = strndup(buf->row[v->cy].chars, colon - buf->row[v->cy].chars);
+    if (path == NULL) die("strndup");
+    ssize_t line = strtoll(colon + 1, NULL, 10);
+
+    editorBuffer *target = editorFindBuffer(path);
+    if (target == NULL) {
+        if (access(path, R_OK) == -1) {
+            editorSetStatusMessage("Can't open %s: %s", path, strerror(errno));
+            free(path);
+            return;
+        }
+        target = editorNewBuffer();
+        editorOpen(target, path);
+    }
+    free(path);
+
+    editorShowBuffer(v, target);
+    v->cy = line - 1 < target->numrows ? line - 1 : target->numrows;
+    if (v->cy < 0) v->cy = 0;
+    v->rowoff = target->numrows;
 }
 
 /* OUTPUT */
-void editorScroll(void) {
-    E.rx = 0;
-    if (E.cy < E.numrows) E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
-    if (E.cy < E.rowoff) E.rowoff = E.cy;
-    if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
-    if (E.rx < E.coloff) E.coloff = E.rx;
-    if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
+void editorScroll(editorView *v) {
+    editorBuffer *buf = v->buf;
+
+    // another view on the same buffer may have removed rows under the cursor
+    if (v->cy > buf->numrows) v->cy = buf->numrows;
+    if (v->cy == buf->numrows) v->cx = 0;
+    else if (v->cx > buf->row[v->cy].size) v->cx = buf->row[v->cy].size;
+    filterFollow(v);
+
+    v->rx = 0;
+    if (v->cy < buf->numrows) v->rx = editorRowCxToRx(&buf->row[v->cy], v->cx);
+    ssize_t line = filterLine(v, v->cy);
+    if (line < v->rowoff) v->rowoff = line;
+    if (line >= v->rowoff + v->screenrows) v->rowoff = line - v->screenrows + 1;
+    if (v->rx < v->coloff) v->coloff = v->rx;
+    if (v->rx >= v->coloff + v->screencols) v->coloff = v->rx - v->screencols + 1;
 }
 
-void editorDrawRows(appendBuffer *ab) {
+void editorDrawRows(editorView *v, appendBuffer *ab) {
+    editorBuffer *buf = v->buf;
     int y;
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows / 3) {
+    for (y = 0; y < v->screenrows; y++) {
+        ssize_t line = y + v->rowoff;
+        if (line >= filterLines(v)) {
+            abAppend(ab, " ", KILO_GUTTER);
+            if (buf->numrows == 0 && E.numviews == 1 && y == v->screenrows / 3) {
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
+                if (welcomelen > v->screencols) welcomelen = v->screencols;
+                int padding = (v->screencols - welcomelen) / 2;
                 if (padding) {
                     abAppend(ab, "~", 1);
                     padding--;
@@ -776,15 +4764,59 @@ void editorDrawRows(appendBuffer *ab) {
                 abAppend(ab, welcome, welcomelen);
             } else abAppend(ab, "~", 1);
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
+            editorRow *row = &buf->row[filterRow(v, line)];
+            diffDrawGutter(buf, row, ab);
+            if (row->hlStale) {
+                long long start = E.perf.pending ? perfNow() : 0;
+                editorHighlightRow(buf, row);
+                if (E.perf.pending) E.perf.highlightNanos += perfNow() - start;
+            }
+            char *c = row->render;
+            unsigned char *hl = row->hl;
+            ssize_t j = 0;
+            ssize_t col = 0;
+            if (row->ascii) {
+                j = v->coloff < row->rsize ? v->coloff : row->rsize;
+                col = j;
+            } else {
+                rowMark *m = editorRowMark(row, row->size, v->coloff);
+                if (m) {
+                    j = m->roff;
+                    col = m->rx;
+                }
+                while (j < row->rsize && col < v->coloff) {
+                    unsigned int cp;
+                    j += unicodeDecode(&c[j], row->rsize - j, &cp);
+                    col += cp == UNICODE_INVALID ? 1 : unicodeWidth(cp);
+                }
+                // a wide character cut by the left edge leaves blank columns
+                for (ssize_t pad = v->coloff; pad < col; pad++) abAppend(ab, " ", 1);
+            }
+
+            // extra cursors show as inverted cells
+            ssize_t k = cursorsFind(v, row->idx);
+            ssize_t cursorrx = cursorsRx(v, row, &k);
+            while (cursorrx != -1 && cursorrx < col) cursorrx = cursorsRx(v, row, &k);
+
             int current_colour = -1;
-            for (int j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+            while (j < row->rsize) {
+                unsigned int cp = (unsigned char)c[j];
+                int n = 1;
+                int w = 1;
+                if (!row->ascii) {
+                    n = unicodeDecode(&c[j], row->rsize - j, &cp);
+                    w = cp == UNICODE_INVALID ? 1 : unicodeWidth(cp);
+                }
+                if (col + w - v->coloff > v->screencols) break;
+                int atCursor = col == cursorrx;
+                if (atCursor) {
+                    abAppend(ab, "\x1b[7m", 4);
+                    while (cursorrx != -1 && cursorrx <= col) cursorrx = cursorsRx(v, row, &k);
+                }
+                col += w;
+
+                if (cp < 0x20 || cp == 0x7f || (cp >= 0x80 && cp < 0xa0) || cp == UNICODE_INVALID) {
+                    char sym = (cp <= 26) ? '@' + cp : '?';
                     abAppend(ab, "\x1b[7m", 4);
                     abAppend(ab, &sym, 1);
                     abAppend(ab, "\x1b[m", 3);
@@ -798,7 +4830,7 @@ void editorDrawRows(appendBuffer *ab) {
                         abAppend(ab, "\x1b[39m", 5);
                         current_colour = -1;
                     }
-                    abAppend(ab, &c[j], 1);
+                    abAppend(ab, &c[j], n);
                 } else {
                     int colour = editorSyntaxToColour(hl[j]);
                     if (colour != current_colour) {
@@ -807,9 +4839,12 @@ void editorDrawRows(appendBuffer *ab) {
                         int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
                         abAppend(ab, buf, clen);
                     }
-                    abAppend(ab, &c[j], 1);
+                    abAppend(ab, &c[j], n);
                 }
+                if (atCursor) abAppend(ab, "\x1b[27m", 5);
+                j += n;
             }
+            if (cursorrx == col && col - v->coloff < v->screencols) abAppend(ab, "\x1b[7m \x1b[27m", 10);
             abAppend(ab, "\x1b[39m", 5);
         }
 
@@ -818,17 +4853,26 @@ void editorDrawRows(appendBuffer *ab) {
     }
 }
 
-void editorDrawStatusBar(appendBuffer *ab) {
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(editorView *v, appendBuffer *ab) {
+    editorBuffer *buf = v->buf;
+    abAppend(ab, v == E.view ? "\x1b[7m" : "\x1b[2;7m", v == E.view ? 4 : 6);
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                        E.filename ? E.filename : "[No Name]",
-                        E.numrows,
-                        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                        E.syntax ? E.syntax->filetype : "no ft",
-                        E.cy + 1,
-                        E.numrows);
+    char filter[40] = "";
+    if (v->filter.query)
+        snprintf(filter, sizeof(filter), " (%zd match \"%.16s\")", v->filter.numrows, v->filter.query);
+    char cursors[32] = "";
+    if (v->multi.num)
+        snprintf(cursors, sizeof(cursors), " (%zd cursors)", v->multi.num + 1);
+    int len = snprintf(status, sizeof(status), "%.20s - %zd lines%s%s %s",
+                        buf->filename ? buf->filename : buf->grep ? "[Grep]" : "[No Name]",
+                        buf->numrows,
+                        filter,
+                        cursors,
+                        buf->dirty ? "(modified)" : buf->streamfd != -1 ? "(loading)" : "");
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %zd/%zd",
+                        buf->syntax ? buf->syntax->filetype : "no ft",
+                        v->cy + 1,
+                        buf->numrows);
     if (len > E.screencols) len = E.screencols;
     abAppend(ab, status, len);
     while (len < E.screencols) {
@@ -846,31 +4890,61 @@ void editorDrawStatusBar(appendBuffer *ab) {
 
 void editorDrawMessageBar(appendBuffer *ab) {
     abAppend(ab, "\x1b[K", 3);
+    if (E.perf.overlay) {
+        perfDrawOverlay(ab);
+        return;
+    }
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsgTime < 5) abAppend(ab, E.statusmsg, msglen);
 }
 
 void editorRefreshScreen(void) {
-    editorScroll();
+    long long frameStart = 0;
+    long long keyHighlight = 0;
+    if (E.perf.pending) {
+        frameStart = perfNow();
+        keyHighlight = E.perf.highlightNanos;
+        perfRecord(PERF_PROCESS, frameStart - E.perf.keyStart - keyHighlight);
+    }
 
     appendBuffer appendBuffer = ABUF_INIT;
 
     abAppend(&appendBuffer, "\x1b[?25l", 6);
     abAppend(&appendBuffer, "\x1b[H", 3);
 
-    editorDrawRows(&appendBuffer);
-    editorDrawStatusBar(&appendBuffer);
+    for (int i = 0; i < E.numviews; i++) {
+        diffUpdate(E.views[i].buf);
+        editorScroll(&E.views[i]);
+        editorDrawRows(&E.views[i], &appendBuffer);
+        editorDrawStatusBar(&E.views[i], &appendBuffer);
+    }
     editorDrawMessageBar(&appendBuffer);
 
+    editorView *v = E.view;
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", v->top + (int)(filterLine(v, v->cy) - v->rowoff) + 1, (int)(v->rx - v->coloff) + 1 + KILO_GUTTER);
     abAppend(&appendBuffer, buf, strlen(buf));
 
     abAppend(&appendBuffer, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, appendBuffer.buf, appendBuffer.len);
+    long long writeStart = E.perf.pending ? perfNow() : 0;
+    if (E.replay.active) {
+        E.replay.frames++;
+        E.replay.bytes += appendBuffer.len;
+    } else write(STDOUT_FILENO, appendBuffer.buf, appendBuffer.len);
     abFree(&appendBuffer);
+
+    if (E.perf.pending) {
+        long long end = perfNow();
+        // rows left stale by the key are highlighted while drawing, which
+        // counts as highlighting rather than building the frame
+        perfRecord(PERF_HIGHLIGHT, E.perf.highlightNanos);
+        perfRecord(PERF_FRAME, writeStart - frameStart - (E.perf.highlightNanos - keyHighlight));
+        perfRecord(PERF_WRITE, end - writeStart);
+        perfRecord(PERF_TOTAL, end - E.perf.keyStart);
+        E.perf.pending = 0;
+    }
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -882,9 +4956,12 @@ void editorSetStatusMessage(const char *fmt, ...) {
 }
 
 /* INPUT */
+// The line being typed is counted with the frame it's drawn in; the answer is
+// handed back as a plain string for the caller to keep or free.
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+    char *buf = memMalloc(MEM_FRAME, bufsize);
+    if (buf == NULL) die("malloc");
 
     size_t buflen = 0;
     buf[0] = '\0';
@@ -899,18 +4976,22 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
             if (callback) callback(buf, c);
-            free(buf);
+            memFree(MEM_FRAME, buf);
             return NULL;
         } else if (c == '\r') {
             if (buflen != 0) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, c);
-                return buf;
+                char *answer = strdup(buf);
+                if (answer == NULL) die("strdup");
+                memFree(MEM_FRAME, buf);
+                return answer;
             }
         } else if (!iscntrl(c) && c < 128) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
-                buf = realloc(buf, bufsize);
+                buf = memRealloc(MEM_FRAME, buf, bufsize);
+                if (buf == NULL) die("realloc");
             }
             buf[buflen++] = c;
             buf[buflen] = '\0';
@@ -920,90 +5001,184 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     }
 }
 
-void editorMoveCursor(int key) {
-    editorRow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+void editorMoveCursor(editorView *v, int key) {
+    editorBuffer *buf = v->buf;
+    editorRow *row = (v->cy >= buf->numrows) ? NULL : &buf->row[v->cy];
 
     switch (key) {
         case ARROW_LEFT:
-            if (E.cx != 0) E.cx--;
-            else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
+            if (row && v->cx != 0) v->cx = editorRowPrevCluster(row, v->cx);
+            else if (filterLine(v, v->cy) > 0) {
+                v->cy = filterRow(v, filterLine(v, v->cy) - 1);
+                v->cx = buf->row[v->cy].size;
             }
             break;
         case ARROW_RIGHT:
-            if (row && E.cx < row->size) E.cx++;
-            else if (row && E.cx == row->size) {
-                E.cy++;
-                E.cx = 0;
+            if (row && v->cx < row->size) v->cx = editorRowNextCluster(row, v->cx);
+            else if (row && v->cx == row->size) {
+                v->cy = filterRow(v, filterLine(v, v->cy + 1));
+                v->cx = 0;
             }
             break;
         case ARROW_UP:
-            if (E.cy != 0) E.cy--;
+            if (filterLine(v, v->cy) > 0) v->cy = filterRow(v, filterLine(v, v->cy) - 1);
             break;
         case ARROW_DOWN:
-            if (E.cy < E.numrows) E.cy++;
+            if (v->cy < buf->numrows) v->cy = filterRow(v, filterLine(v, v->cy + 1));
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen)
-        E.cx = rowlen;
+    row = (v->cy >= buf->numrows) ? NULL : &buf->row[v->cy];
+    ssize_t rowlen = row ? row->size : 0;
+    if (v->cx > rowlen)
+        v->cx = rowlen;
+    while (row && !editorRowIsClusterStart(row, v->cx)) v->cx--;
+}
+
+int editorUnsavedBuffers(void) {
+    int unsaved = 0;
+    for (int i = 0; i < E.numbuffers; i++)
+        if (E.buffers[i]->dirty > 0) unsaved++;
+
+    return unsaved;
 }
 
 void editorProcessKeyPress(void) {
     static int quit_times = KILO_QUIT_TIMES;
     
     int c = editorReadKey();
+    editorView *v = E.view;
+
+    if (v->multi.num > 0 && editorCursorsKey(v, c)) {
+        quit_times = KILO_QUIT_TIMES;
+        return;
+    }
 
     switch (c) {
         case '\r':
-            editorInsertNewLine();
+            if (v->buf->grep) editorGrepOpen(v);
+            else editorInsertNewLine(v);
             break;
 
         case CTRL_KEY('q'):
-            if (E.dirty > 0 && quit_times > 0) {
-                editorSetStatusMessage("WARNING! File has unsaved changes. Press Ctrl-Q %d more times to quit.", quit_times);
+            if (editorUnsavedBuffers() > 0 && quit_times > 0) {
+                editorSetStatusMessage("WARNING! %d file(s) have unsaved changes. Press Ctrl-Q %d more times to quit.", editorUnsavedBuffers(), quit_times);
                 quit_times--;
                 return;
             }
+            if (E.replay.active) replayFinish();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
             break;
 
         case CTRL_KEY('s'):
-            editorSave();
+            editorSave(v->buf);
+            break;
+
+        case CTRL_KEY('o'):
+            editorOpenPrompt();
+            break;
+
+        case CTRL_KEY('w'):
+            editorSplitView();
+            break;
+
+        case CTRL_KEY('k'):
+            editorCloseView();
+            break;
+
+        case CTRL_KEY('n'):
+            editorNextView();
+            break;
+
+        case CTRL_KEY('b'):
+            editorNextBuffer();
+            break;
+
+        case CTRL_KEY('p'):
+            perfToggleOverlay();
             break;
 
         case HOME_KEY:
-            E.cx = 0;
+            v->cx = 0;
             break;
 
         case END_KEY:
-            if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+            if (v->cy < v->buf->numrows) v->cx = v->buf->row[v->cy].size;
             break;
 
         case CTRL_KEY('f'):
             editorFind();
             break;
 
+        case CTRL_KEY('l'):
+            editorFilter();
+            break;
+
+        case CTRL_KEY('g'):
+            editorGrep();
+            break;
+
+        case CTRL_KEY('t'):
+            editorMemoryReport();
+            break;
+
+        case CTRL_KEY('@'):
+            v->marked = !v->marked;
+            v->markx = v->cx;
+            v->marky = v->cy;
+            editorSetStatusMessage(v->marked ? "Mark set" : "Mark cleared");
+            break;
+
+        case CTRL_KEY('e'):
+            editorLineCommand();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo(v->buf);
+            break;
+
+        case CTRL_KEY('c'):
+            editorCopy(v);
+            break;
+
+        case CTRL_KEY('x'):
+            editorCut(v);
+            break;
+
+        case CTRL_KEY('v'):
+            editorPaste(v);
+            break;
+
+        case CTRL_KEY('y'):
+            editorYankPop(v);
+            break;
+
+        case CTRL_KEY('d'):
+            editorAddCursorBelow(v);
+            break;
+
+        case CTRL_KEY('r'):
+            editorBlockCursors(v);
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
-            if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
-            editorDeleteChar();
+            if (c == DEL_KEY) editorMoveCursor(v, ARROW_RIGHT);
+            editorDeleteChar(v);
             break;
 
         case PAGE_UP:
         case PAGE_DOWN:
             {
                 if (c == PAGE_UP)
-                    E.cy = E.rowoff;
+                    v->cy = filterRow(v, v->rowoff);
                 else if (c == PAGE_DOWN) {
-                    E.cy = E.rowoff + E.screenrows - 1;
-                    if (E.cy > E.numrows) E.cy = E.numrows;
+                    ssize_t line = v->rowoff + v->screenrows - 1;
+                    if (line > filterLines(v)) line = filterLines(v);
+                    v->cy = filterRow(v, line);
                 }
             }
             break;
@@ -1012,15 +5187,14 @@ void editorProcessKeyPress(void) {
         case ARROW_DOWN:
         case ARROW_LEFT:
         case ARROW_RIGHT:
-            editorMoveCursor(c);
+            editorMoveCursor(v, c);
             break;
 
-        case CTRL_KEY('l'):
         case '\x1b':
             break;
         
         default:
-            editorInsertChar(c);
+            editorInsertChar(v, c);
             break;
     }
 
@@ -1029,35 +5203,51 @@ void editorProcessKeyPress(void) {
 
 /* INIT */
 void initEditor(void) {
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    E.buffers = NULL;
+    E.numbuffers = 0;
+    E.numviews = 1;
+    E.view = &E.views[0];
     E.statusmsg[0] = '\0';
     E.statusmsgTime = 0;
-    E.syntax = NULL;
 
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-    E.screenrows -= 2;
+    if (!E.replay.active) {
+        E.infd = STDIN_FILENO;
+        if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    }
+    E.screenrows -= 1;
+
+    editorShowBuffer(E.view, editorNewBuffer());
+    editorLayoutViews();
 }
 
+#ifndef KILO_NO_MAIN
 int main(int argc, char *argv[]) {
-    enableRawMode();
+    char *replay = NULL;
+    char *size = NULL;
+    int argi = 1;
+    while (argi + 1 < argc && !strncmp(argv[argi], "--", 2)) {
+        if (!strcmp(argv[argi], "--replay")) replay = argv[argi + 1];
+        else if (!strcmp(argv[argi], "--size")) size = argv[argi + 1];
+        else break;
+        argi += 2;
+    }
+
+    if (replay) replayStart(replay, size);
+    else enableRawMode();
     initEditor();
     
-    if (argc >= 2) {
+    if (argc > argi) {
         wordexp_t expanded;
-        wordexp(argv[1], &expanded, 0);
+        wordexp(argv[argi], &expanded, 0);
         char *path = expanded.we_wordv[0];
-        editorOpen(path);
+        editorOpen(E.view->buf, path);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find");
+    editorSetStatusMessage("HELP: Ctrl-Q quit | Ctrl-S save | Ctrl-F find | Ctrl-L filter | Ctrl-O open | Ctrl-W split");
+
+    E.perf.enabled = 1;
+    atexit(perfDump);
+    E.replay.start = perfNow();
 
     while (1) {
         editorRefreshScreen();
@@ -1066,3 +5256,4 @@ int main(int argc, char *argv[]) {
 
     return 0;
 }
+#endif